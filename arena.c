@@ -0,0 +1,99 @@
+//
+// Created by Keuin on 2022/1/9.
+//
+// All long-lived state (targets, statistics, buffers) is carved from a
+// single memory region mapped once at startup. Modules declare how much
+// they need with arena_reserve() while the configuration is parsed, then
+// arena_init() maps exactly that much and arena_alloc() hands it out.
+// Nothing is ever freed, so no heap allocation happens after startup.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "arena.h"
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+static unsigned char *base = NULL;
+static size_t reserved = 0;
+static size_t used = 0;
+
+/**
+ * Declare that `size` more bytes will be allocated from the arena.
+ * Must be called before arena_init().
+ */
+void arena_reserve(size_t size) {
+    reserved += ALIGN_UP(size);
+}
+
+/**
+ * Map the arena. Pages are populated eagerly, so the resident size
+ * does not grow as the arena is consumed.
+ * @return Zero if success, non-zero if failed.
+ */
+int arena_init(void) {
+    if (base != NULL) return -1;
+    if (reserved == 0) reserved = ARENA_ALIGN;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) reserved = (reserved + page - 1) & ~((size_t) page - 1);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *p = mmap(NULL, reserved, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap()");
+        return -1;
+    }
+    base = p;
+    return 0;
+}
+
+/**
+ * Allocate a zero-filled block from the arena.
+ * @return The block, or NULL if the arena is not initialized or the
+ * reservation is exhausted.
+ */
+void *arena_alloc(size_t size) {
+    size = ALIGN_UP(size);
+    if (base == NULL || size > reserved - used) return NULL;
+    void *p = base + used;
+    used += size;
+    return p;
+}
+
+char *arena_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(len);
+    if (p) memcpy(p, s, len);
+    return p;
+}
+
+size_t arena_size(void) {
+    return reserved;
+}
+
+size_t arena_used(void) {
+    return used;
+}
+
+/**
+ * @return Resident set size of this process in bytes, or -1 if unknown.
+ */
+long rss_bytes(void) {
+    // avoid stdio here, fopen() allocates a buffer from the heap
+    char buf[64];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t rd = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (rd <= 0) return -1;
+    buf[rd] = '\0';
+    char *p = strchr(buf, ' ');
+    if (!p) return -1;
+    return strtol(p + 1, NULL, 10) * sysconf(_SC_PAGESIZE);
+}
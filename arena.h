@@ -0,0 +1,27 @@
+//
+// Created by Keuin on 2022/1/9.
+//
+
+#ifndef NETMON_ARENA_H
+#define NETMON_ARENA_H
+
+#include <stddef.h>
+
+// alignment of every block carved from the arena
+#define ARENA_ALIGN 16
+
+void arena_reserve(size_t size);
+
+int arena_init(void);
+
+void *arena_alloc(size_t size);
+
+char *arena_strdup(const char *s);
+
+size_t arena_size(void);
+
+size_t arena_used(void);
+
+long rss_bytes(void);
+
+#endif //NETMON_ARENA_H
@@ -0,0 +1,397 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+// Collector mode: ingest telemetry summaries pushed by many netmon sites
+// into an in-memory table, and answer queries about them over TCP on
+// the same port. Send a line with a site name to get that site, or an
+// empty line (or `*`) to get all of them.
+//
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "arena.h"
+#include "collector.h"
+#include "logging.h"
+#include "telemetry.h"
+
+struct site {
+    // zero if the slot is free
+    int used;
+    struct sockaddr_in addr;
+    time_t first_seen;
+    time_t last_seen;
+    uint64_t datagrams;
+    // summaries missing according to sequence numbers
+    uint64_t lost;
+    // times the site was seen starting over with a new boot time
+    uint64_t restarts;
+    struct telemetry_summary last;
+};
+
+struct query_client {
+    int fd;
+    // when the client connected, slow clients are dropped after a while
+    time_t since;
+    size_t len;
+    char line[COLLECTOR_QUERY_MAX];
+    // non-zero once the query is read and the reply is being sent
+    int answering;
+    // next slot of the table to dump, c->slots if nothing is left
+    size_t cursor;
+    // the part of the reply not sent yet is out[out_off, out_len)
+    size_t out_off, out_len;
+    char out[COLLECTOR_REPLY_MAX];
+};
+
+struct collector {
+    int udp, tcp;
+    // table size, a power of two at least twice the max site count
+    size_t slots;
+    size_t max_sites;
+    size_t n_sites;
+    uint64_t received;
+    uint64_t malformed;
+    uint64_t dropped;
+    struct site *sites;
+    struct query_client clients[COLLECTOR_QUERY_CLIENTS];
+    unsigned char bufs[COLLECTOR_BATCH][TELEMETRY_MAX_DATAGRAM];
+    struct sockaddr_in addrs[COLLECTOR_BATCH];
+    struct iovec iovs[COLLECTOR_BATCH];
+    struct mmsghdr msgs[COLLECTOR_BATCH];
+    struct telemetry_summary sum;
+};
+
+static size_t table_slots(size_t max_sites) {
+    size_t n = 16;
+    while (n < max_sites * 2) n <<= 1;
+    return n;
+}
+
+/**
+ * @return Bytes the collector will allocate from the arena.
+ */
+size_t collector_footprint(size_t max_sites) {
+    return sizeof(struct collector) +
+           table_slots(max_sites) * sizeof(struct site);
+}
+
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Find the slot of a site, or claim a free one for it.
+ * @return The slot, or NULL if the table is full.
+ */
+static struct site *lookup(struct collector *c, const char *name, int create) {
+    size_t mask = c->slots - 1;
+    for (size_t i = fnv1a(name) & mask;; i = (i + 1) & mask) {
+        struct site *s = &c->sites[i];
+        if (!s->used) {
+            if (!create || c->n_sites >= c->max_sites) return NULL;
+            s->used = 1;
+            ++c->n_sites;
+            return s;
+        }
+        if (strcmp(s->last.site, name) == 0) return s;
+    }
+}
+
+static void ingest(struct collector *c, const unsigned char *buf, size_t len,
+                   const struct sockaddr_in *from, time_t now) {
+    ++c->received;
+    if (telemetry_decode(buf, len, &c->sum) || c->sum.site[0] == '\0') {
+        ++c->malformed;
+        return;
+    }
+    struct site *s = lookup(c, c->sum.site, 1);
+    if (!s) {
+        ++c->dropped;
+        return;
+    }
+    if (s->datagrams == 0) {
+        s->first_seen = now;
+    } else if (c->sum.boot != s->last.boot) {
+        // the site restarted, its sequence numbers start over from zero
+        ++s->restarts;
+        s->lost += c->sum.seq;
+    } else if (c->sum.seq > s->last.seq + 1) {
+        s->lost += c->sum.seq - s->last.seq - 1;
+    } else if (c->sum.seq <= s->last.seq) {
+        return; // duplicated or reordered, keep the newer one
+    }
+    ++s->datagrams;
+    s->last_seen = now;
+    s->addr = *from;
+    s->last = c->sum;
+}
+
+static void receive_batch(void *logger, struct collector *c) {
+    int n = recvmmsg(c->udp, c->msgs, COLLECTOR_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmmsg()");
+            log_error(logger, "recvmmsg() failed.");
+        }
+        return;
+    }
+    time_t now = time(NULL);
+    for (int i = 0; i < n; ++i) {
+        ingest(c, c->bufs[i], c->msgs[i].msg_len, &c->addrs[i], now);
+        // reset for the next call, the kernel updated them
+        c->msgs[i].msg_hdr.msg_namelen = sizeof(c->addrs[i]);
+    }
+}
+
+/**
+ * Append a line to the reply of a client.
+ * @return Zero if it fits into the buffer, non-zero otherwise.
+ */
+static int reply(struct query_client *q, const char *fmt, ...) {
+    char buf[COLLECTOR_REPLY_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0) return -1;
+    if ((size_t) len >= sizeof(buf)) len = sizeof(buf) - 1;
+    if (q->out_len + (size_t) len > sizeof(q->out)) return -1;
+    memcpy(q->out + q->out_len, buf, (size_t) len);
+    q->out_len += (size_t) len;
+    return 0;
+}
+
+static int dump_site(struct query_client *q, const struct site *s) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &s->addr.sin_addr, addr, sizeof(addr));
+    if (reply(q, "site %s addr %s:%u first_seen %ld last_seen %ld "
+                 "seq %llu datagrams %llu lost %llu restarts %llu "
+                 "targets %u\n",
+              s->last.site, addr, ntohs(s->addr.sin_port),
+              (long) s->first_seen, (long) s->last_seen,
+              (unsigned long long) s->last.seq,
+              (unsigned long long) s->datagrams,
+              (unsigned long long) s->lost,
+              (unsigned long long) s->restarts, s->last.n_targets))
+        return -1;
+    for (unsigned i = 0; i < s->last.n_targets; ++i) {
+        const struct telemetry_target *t = &s->last.targets[i];
+        if (reply(q, "  target %s up %u last_change %llu probes %u "
+                     "failures %u transitions %u p50 %ld p90 %ld p99 %ld\n",
+                  t->name, t->up, (unsigned long long) t->last_change,
+                  t->probes, t->failures, t->transitions,
+                  t->p50, t->p90, t->p99))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append as many whole sites from the cursor on as fit into the buffer.
+ */
+static void fill(struct collector *c, struct query_client *q) {
+    for (; q->cursor < c->slots; ++q->cursor) {
+        size_t mark = q->out_len;
+        if (!c->sites[q->cursor].used) continue;
+        if (dump_site(q, &c->sites[q->cursor])) {
+            // an empty buffer holds any site, see COLLECTOR_REPLY_MAX
+            q->out_len = mark;
+            return;
+        }
+    }
+}
+
+static void answer(struct collector *c, struct query_client *q) {
+    const char *query = q->line;
+    q->answering = 1;
+    q->out_off = q->out_len = 0;
+    q->cursor = c->slots;
+    if (query[0] != '\0' && strcmp(query, "*") != 0) {
+        const struct site *s = lookup(c, query, 0);
+        if (s) dump_site(q, s);
+        else reply(q, "unknown site %s\n", query);
+        return;
+    }
+    reply(q, "collector sites %zu received %llu malformed %llu "
+             "dropped %llu\n", c->n_sites,
+          (unsigned long long) c->received,
+          (unsigned long long) c->malformed,
+          (unsigned long long) c->dropped);
+    q->cursor = 0;
+    fill(c, q);
+}
+
+/**
+ * Send as much of the reply as the socket takes without blocking, so a
+ * slow client never holds up ingestion.
+ * @return Zero if the rest has to wait for POLLOUT, non-zero if the reply
+ * is complete or the client is gone.
+ */
+static int flush(struct collector *c, struct query_client *q) {
+    while (1) {
+        if (q->out_off == q->out_len) {
+            q->out_off = q->out_len = 0;
+            fill(c, q);
+            if (q->out_len == 0) return 1;
+        }
+        ssize_t wr = send(q->fd, q->out + q->out_off, q->out_len - q->out_off,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (wr < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR) ? 0 : -1;
+        q->out_off += (size_t) wr;
+    }
+}
+
+static void drop(struct query_client *q) {
+    close(q->fd);
+    q->fd = -1;
+}
+
+static void accept_client(struct collector *c, time_t now) {
+    int fd = accept(c->tcp, NULL, NULL);
+    if (fd < 0) return;
+    for (int i = 0; i < COLLECTOR_QUERY_CLIENTS; ++i) {
+        struct query_client *q = &c->clients[i];
+        if (q->fd < 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            q->fd = fd;
+            q->since = now;
+            q->len = 0;
+            q->answering = 0;
+            return;
+        }
+    }
+    close(fd); // too many queries at once
+}
+
+static void serve_client(struct collector *c, struct query_client *q) {
+    if (q->answering) {
+        if (flush(c, q)) drop(q);
+        return;
+    }
+    ssize_t rd = recv(q->fd, q->line + q->len,
+                      sizeof(q->line) - 1 - q->len, 0);
+    if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (rd <= 0) {
+        drop(q);
+        return;
+    }
+    q->len += (size_t) rd;
+    q->line[q->len] = '\0';
+    char *eol = strpbrk(q->line, "\r\n");
+    if (!eol && q->len < sizeof(q->line) - 1) return;
+    if (eol) *eol = '\0';
+    answer(c, q);
+    if (flush(c, q)) drop(q);
+}
+
+static int open_sockets(void *logger, struct collector *c, uint16_t port) {
+    struct sockaddr_in addr;
+    int one = 1, rcvbuf = 4 << 20;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((c->udp = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        (c->tcp = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    // absorb bursts while a query is being answered
+    setsockopt(c->udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(c->tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(c->udp, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        bind(c->tcp, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        log_error(logger, "bind() failed.");
+        return -1;
+    }
+    if (listen(c->tcp, COLLECTOR_QUERY_CLIENTS) < 0) {
+        perror("listen()");
+        log_error(logger, "listen() failed.");
+        return -1;
+    }
+    fcntl(c->tcp, F_SETFL, fcntl(c->tcp, F_GETFL, 0) | O_NONBLOCK);
+    return 0;
+}
+
+/**
+ * Run as a collector. Never returns unless failed.
+ * @param logger the logger.
+ * @param port UDP port to receive summaries on, and TCP port to answer
+ * queries on.
+ * @param max_sites max number of sites to track.
+ * @return Non-zero if failed.
+ */
+int collector_run(void *logger, uint16_t port, size_t max_sites) {
+    struct collector *c = arena_alloc(sizeof(struct collector));
+    size_t slots = table_slots(max_sites);
+    if (!c || !(c->sites = arena_alloc(slots * sizeof(struct site)))) {
+        log_error(logger, "Cannot allocate the site table.");
+        return -1;
+    }
+    c->slots = slots;
+    c->max_sites = max_sites;
+    for (int i = 0; i < COLLECTOR_QUERY_CLIENTS; ++i) c->clients[i].fd = -1;
+    for (int i = 0; i < COLLECTOR_BATCH; ++i) {
+        c->iovs[i].iov_base = c->bufs[i];
+        c->iovs[i].iov_len = sizeof(c->bufs[i]);
+        c->msgs[i].msg_hdr.msg_iov = &c->iovs[i];
+        c->msgs[i].msg_hdr.msg_iovlen = 1;
+        c->msgs[i].msg_hdr.msg_name = &c->addrs[i];
+        c->msgs[i].msg_hdr.msg_namelen = sizeof(c->addrs[i]);
+    }
+    if (open_sockets(logger, c, port)) return -1;
+
+    char buf[64];
+    snprintf(buf, 63, "Collector is listening on port %u.", port);
+    log_info(logger, buf);
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "EndlessLoop"
+    while (1) {
+        struct pollfd pfds[2 + COLLECTOR_QUERY_CLIENTS];
+        int n = 0, busy = 0;
+        time_t now = time(NULL);
+        pfds[n++] = (struct pollfd) {c->udp, POLLIN, 0};
+        pfds[n++] = (struct pollfd) {c->tcp, POLLIN, 0};
+        for (int i = 0; i < COLLECTOR_QUERY_CLIENTS; ++i) {
+            struct query_client *q = &c->clients[i];
+            if (q->fd >= 0 && now - q->since > COLLECTOR_QUERY_TIMEOUT)
+                drop(q);
+            busy |= (q->fd >= 0);
+            pfds[n++] = (struct pollfd) {q->fd, q->answering ? POLLOUT : POLLIN,
+                                         0};
+        }
+        // wake up now and then to drop clients that stopped reading
+        if (poll(pfds, (nfds_t) n, busy ? 1000 : -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll()");
+            log_error(logger, "poll() failed.");
+            return -1;
+        }
+        if (pfds[0].revents) receive_batch(logger, c);
+        if (pfds[1].revents) accept_client(c, now);
+        for (int i = 0; i < COLLECTOR_QUERY_CLIENTS; ++i) {
+            if (c->clients[i].fd >= 0 && pfds[2 + i].revents)
+                serve_client(c, &c->clients[i]);
+        }
+    }
+#pragma clang diagnostic pop
+}
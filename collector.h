@@ -0,0 +1,30 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+
+#ifndef NETMON_COLLECTOR_H
+#define NETMON_COLLECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "telemetry.h"
+
+#define COLLECTOR_DEFAULT_SITES 1024
+// datagrams received with one recvmmsg() call
+#define COLLECTOR_BATCH 64
+// concurrent connections to the query endpoint
+#define COLLECTOR_QUERY_CLIENTS 8
+#define COLLECTOR_QUERY_MAX 128
+// longest line of a reply, and the reply buffer of one connection, which
+// holds at least one whole site
+#define COLLECTOR_REPLY_LINE 256
+#define COLLECTOR_REPLY_MAX (2 * (1 + TELEMETRY_MAX_TARGETS) * \
+                             COLLECTOR_REPLY_LINE)
+// seconds a query connection may stay open
+#define COLLECTOR_QUERY_TIMEOUT 10
+
+size_t collector_footprint(size_t max_sites);
+
+int collector_run(void *logger, uint16_t port, size_t max_sites);
+
+#endif //NETMON_COLLECTOR_H
@@ -0,0 +1,357 @@
+//
+// Created by Keuin on 2022/1/17.
+//
+// Control socket: a Unix-domain stream socket served while the monitor
+// sleeps between checks. Clients send one command per line and get the
+// reply terminated by a line of `ok` or `error <reason>`:
+//
+//   status                          dump the state
+//   check                           check now instead of at the next tick
+//   add <target>                    add a target, see target.c
+//   remove <name>                   remove the target of this name
+//   set interval|max-failure|failure-sleep <n>
+//   pause | resume                  skip or run the failure action
+//
+// A command is applied as a whole between two checks, so the monitor
+// never sees it halfway. Sockets are non-blocking and a client that does
+// not read its replies is dropped, so a command never delays a check.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "arena.h"
+#include "control.h"
+#include "logging.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "target.h"
+
+/**
+ * @return Bytes the control socket will allocate from the arena.
+ */
+size_t control_footprint(void) {
+    return sizeof(struct control);
+}
+
+/**
+ * @return Non-zero if someone accepts connections on the socket.
+ */
+static int in_use(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    int rv = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+    // only a refused connection proves the socket is stale
+    int busy = (rv == 0 || (errno != ECONNREFUSED && errno != ENOENT));
+    close(fd);
+    return busy;
+}
+
+/**
+ * Listen on a Unix-domain socket. A stale socket left at the path by a
+ * previous run is replaced, one another netmon still listens on or any
+ * other file is not.
+ * @return The control socket, or NULL if failed.
+ */
+struct control *control_open(void *logger, const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error(logger, "Control socket path is too long.");
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log_error(logger, "Control socket path exists and is not a socket.");
+            return NULL;
+        }
+        if (in_use(&addr)) {
+            log_error(logger, "Control socket is in use by another process.");
+            return NULL;
+        }
+        unlink(path);
+    }
+    struct control *c = arena_alloc(sizeof(struct control));
+    if (!c) {
+        log_error(logger, "Cannot allocate the control socket.");
+        return NULL;
+    }
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return NULL;
+    }
+    if (bind(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        log_error(logger, "bind() failed.");
+        close(c->fd);
+        return NULL;
+    }
+    // whoever can connect can reconfigure the monitor
+    chmod(path, 0600);
+    if (listen(c->fd, CONTROL_CLIENTS) < 0) {
+        perror("listen()");
+        log_error(logger, "listen() failed.");
+        close(c->fd);
+        return NULL;
+    }
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) c->clients[i].fd = -1;
+    return c;
+}
+
+static void out(struct control *c, const char *fmt, ...) {
+    va_list ap;
+    size_t room = sizeof(c->out) - c->out_len;
+    va_start(ap, fmt);
+    int len = vsnprintf(c->out + c->out_len, room, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    c->out_len += ((size_t) len < room) ? (size_t) len : room - 1;
+}
+
+static void dump(struct control *c, const struct monitor *m) {
+    out(c, "interval %u max-failure %d failure-sleep %u actions %s\n",
+        m->check_interval, m->max_failure, m->failure_sleep,
+        m->paused ? "paused" : "enabled");
+    out(c, "failures %d checks %lu skipped %d actions %lu last_check %ld "
+           "last_action %ld rtt %ld us\n",
+        m->failures, m->checks, m->skipped, m->actions,
+        (long) m->last_check, (long) m->last_action, m->last_rtt_us);
+    if (m->load && m->load->last.when) {
+        char buf[256];
+        load_format(&m->load->last, buf, sizeof(buf));
+        out(c, "load %ld %s\n", (long) m->load->last.when, buf);
+    }
+    if (!m->targets) return;
+    for (unsigned i = 0; i < m->targets->n; ++i) {
+        const struct target *t = &m->targets->items[i];
+        const struct target_stats *st = &m->targets->stats[i];
+        out(c, "target %s %s failures %d rtt %ld us last_check %ld "
+               "probes %llu failed %llu p50 %ld p90 %ld p99 %ld\n",
+            st->name, !t->last_check ? "unknown" : st->up ? "up" : "down",
+            t->failures, t->last_rtt_us,
+            (long) t->last_check, (unsigned long long) st->total_probes,
+            (unsigned long long) st->total_failures,
+            stats_percentile(st, 50), stats_percentile(st, 90),
+            stats_percentile(st, 99));
+    }
+}
+
+static const char *add(struct control *c, struct monitor *m, char *args) {
+    struct target t;
+    char name[TARGET_NAME_MAX];
+    if (!m->targets) return "no targets in this mode";
+    if (target_parse(&t, args)) return "invalid target";
+    target_name(&t, name, sizeof(name));
+    if (targets_find(m->targets, name) >= 0) return "target exists";
+    if (targets_add(m->logger, m->targets, &t)) return "too many targets";
+    char buf[96];
+    snprintf(buf, sizeof(buf), "Target %s is added.", name);
+    log_info(m->logger, buf);
+    out(c, "target %s\n", name);
+    return NULL;
+}
+
+static const char *remove_target(struct monitor *m, const char *name) {
+    if (!m->targets || targets_find(m->targets, name) < 0)
+        return "no such target";
+    if (m->targets->n == 1) return "cannot remove the last target";
+    targets_remove(m->targets, name);
+    char buf[96];
+    snprintf(buf, sizeof(buf), "Target %s is removed.", name);
+    log_info(m->logger, buf);
+    return NULL;
+}
+
+static const char *set(struct monitor *m, char *args) {
+    char *save = NULL, *end;
+    const char *key = strtok_r(args, " \t", &save);
+    const char *value = strtok_r(NULL, " \t", &save);
+    if (!key || !value || strtok_r(NULL, " \t", &save))
+        return "usage: set <key> <value>";
+    long v = strtol(value, &end, 10);
+    if (*end != '\0' || v < 0 || v > 86400 * 365) return "invalid value";
+    if (strcmp(key, "interval") == 0) {
+        if (v == 0) return "interval should be positive";
+        m->check_interval = (unsigned int) v;
+    } else if (strcmp(key, "max-failure") == 0) {
+        m->max_failure = (int) v;
+    } else if (strcmp(key, "failure-sleep") == 0) {
+        m->failure_sleep = (unsigned int) v;
+    } else {
+        return "unknown key";
+    }
+    char buf[96];
+    snprintf(buf, sizeof(buf), "Set %s to %ld.", key, v);
+    log_info(m->logger, buf);
+    return NULL;
+}
+
+/**
+ * Run one command and put the reply into the output buffer.
+ */
+static void execute(struct control *c, struct monitor *m, char *line) {
+    const char *err = NULL;
+    int changed = 0;
+    while (*line == ' ' || *line == '\t') ++line;
+    char *args = line + strcspn(line, " \t");
+    if (*args != '\0') *args++ = '\0';
+    if (line[0] == '\0') return;
+    if (strcmp(line, "status") == 0) {
+        dump(c, m);
+    } else if (strcmp(line, "check") == 0) {
+        m->wake = 1;
+    } else if (strcmp(line, "add") == 0) {
+        changed = !(err = add(c, m, args));
+    } else if (strcmp(line, "remove") == 0) {
+        args[strcspn(args, " \t")] = '\0';
+        changed = !(err = remove_target(m, args));
+    } else if (strcmp(line, "set") == 0) {
+        changed = !(err = set(m, args));
+    } else if (strcmp(line, "pause") == 0 || strcmp(line, "resume") == 0) {
+        m->paused = (line[0] == 'p');
+        log_info(m->logger, m->paused ? "Actions are paused." :
+                            "Actions are resumed.");
+        changed = 1;
+    } else if (strcmp(line, "help") == 0) {
+        out(c, "status | check | add <target> | remove <name> | "
+               "set interval|max-failure|failure-sleep <n> | pause | resume\n");
+    } else {
+        err = "unknown command";
+    }
+    if (err) out(c, "error %s\n", err);
+    else out(c, "ok\n");
+    if (changed && m->shm) snapshot_publish(m->shm, m, m->ops->wall(m));
+}
+
+static void drop(struct control_client *cl) {
+    close(cl->fd);
+    cl->fd = -1;
+}
+
+static void serve_client(struct control *c, struct monitor *m,
+                         struct control_client *cl) {
+    ssize_t rd = recv(cl->fd, cl->line + cl->len,
+                      sizeof(cl->line) - 1 - cl->len, 0);
+    if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (rd <= 0) {
+        drop(cl);
+        return;
+    }
+    cl->len += (size_t) rd;
+    cl->line[cl->len] = '\0';
+    char *line = cl->line, *eol;
+    c->out_len = 0;
+    while ((eol = strpbrk(line, "\r\n")) != NULL) {
+        *eol = '\0';
+        execute(c, m, line);
+        line = eol + 1;
+    }
+    if (line == cl->line && cl->len == sizeof(cl->line) - 1) {
+        out(c, "error line too long\n");
+        line = cl->line + cl->len;
+    }
+    cl->len -= (size_t) (line - cl->line);
+    memmove(cl->line, line, cl->len);
+    // never wait for a client that does not read its replies
+    if (c->out_len > 0 &&
+        send(cl->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+        (ssize_t) c->out_len)
+        drop(cl);
+}
+
+static void accept_client(struct control *c) {
+    int fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        if (c->clients[i].fd < 0) {
+            c->clients[i].fd = fd;
+            c->clients[i].len = 0;
+            return;
+        }
+    }
+    close(fd); // too many clients at once
+}
+
+/**
+ * Close the control socket and all its clients.
+ */
+static void control_close(struct control *c) {
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        if (c->clients[i].fd >= 0) drop(&c->clients[i]);
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * Wait up to the timeout for the control socket, and serve whatever is
+ * ready.
+ * @return Zero if success, non-zero if the socket failed and was closed.
+ */
+static int serve_ready(struct control *c, struct monitor *m, int timeout_ms) {
+    struct pollfd pfds[1 + CONTROL_CLIENTS];
+    pfds[0] = (struct pollfd) {c->fd, POLLIN, 0};
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        pfds[1 + i] = (struct pollfd) {c->clients[i].fd, POLLIN, 0};
+    }
+    int n = poll(pfds, 1 + CONTROL_CLIENTS, timeout_ms);
+    if (n <= 0) {
+        if (n < 0 && errno != EINTR) {
+            perror("poll()");
+            log_error(m->logger, "poll() failed, "
+                                 "the control socket is disabled.");
+            control_close(c);
+            return -1;
+        }
+        return 0;
+    }
+    if (pfds[0].revents) accept_client(c);
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        if (c->clients[i].fd >= 0 && pfds[1 + i].revents)
+            serve_client(c, m, &c->clients[i]);
+    }
+    return 0;
+}
+
+/**
+ * Serve the control socket until the deadline, or until a command asks
+ * for a check.
+ * @param c the control socket.
+ * @param m the monitor to control.
+ * @param until_us the deadline, in m->ops->now_us() time.
+ * @return Zero if success, non-zero if the socket failed and was closed.
+ * The caller has to wait out the rest of the time then.
+ */
+int control_serve(struct control *c, struct monitor *m, long long until_us) {
+    while (!m->wake && !monitor_stop_requested()) {
+        long long left = until_us - m->ops->now_us(m);
+        if (left <= 0) return 0;
+        if (serve_ready(c, m, (int) ((left + 999) / 1000))) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Serve what is pending on the control socket without waiting, e.g.
+ * while a long measurement is running.
+ * @return Zero if success, non-zero if the socket failed and was closed.
+ */
+int control_poll(struct control *c, struct monitor *m) {
+    return serve_ready(c, m, 0);
+}
@@ -0,0 +1,39 @@
+//
+// Created by Keuin on 2022/1/17.
+//
+
+#ifndef NETMON_CONTROL_H
+#define NETMON_CONTROL_H
+
+#include <stddef.h>
+
+// concurrent connections to the control socket
+#define CONTROL_CLIENTS 4
+#define CONTROL_LINE_MAX 320
+// a reply larger than this is cut off
+#define CONTROL_REPLY_MAX 2048
+
+struct monitor;
+
+struct control_client {
+    int fd;
+    size_t len;
+    char line[CONTROL_LINE_MAX];
+};
+
+struct control {
+    int fd;
+    struct control_client clients[CONTROL_CLIENTS];
+    size_t out_len;
+    char out[CONTROL_REPLY_MAX];
+};
+
+size_t control_footprint(void);
+
+struct control *control_open(void *logger, const char *path);
+
+int control_serve(struct control *c, struct monitor *m, long long until_us);
+
+int control_poll(struct control *c, struct monitor *m);
+
+#endif //NETMON_CONTROL_H
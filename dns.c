@@ -0,0 +1,523 @@
+//
+// Created by Keuin on 2022/1/8.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "dns.h"
+#include "logging.h"
+#include "validate.h"
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char) (v >> 8);
+    p[1] = (unsigned char) v;
+}
+
+static long elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+           (now.tv_nsec - since->tv_nsec) / 1000L;
+}
+
+/**
+ * Generate a query id. Not cryptographically strong, but unpredictable
+ * enough to tell our replies from stale ones.
+ */
+static uint16_t next_id(void) {
+    static uint32_t x = 0;
+    if (x == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = (uint32_t) ts.tv_nsec ^ ((uint32_t) getpid() << 16) ^ 0x9e3779b9u;
+        if (x == 0) x = 1;
+    }
+    // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (uint16_t) (x ^ (x >> 16));
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Parse a resolver address in the form of `ip` or `ip:port`.
+ * @param s the string.
+ * @param addr where to store the address.
+ * @return Zero if success, non-zero if failed.
+ */
+int dns_parse_server(const char *s, struct sockaddr_in *addr) {
+    return parse_ipv4_endpoint(s, DNS_PORT, addr);
+}
+
+static int read_resolv_conf(struct sockaddr_in *addr) {
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+    char line[256], ns[64];
+    int rv = -1;
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, " nameserver %63s", ns) == 1 &&
+            dns_parse_server(ns, addr) == 0) {
+            rv = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return rv;
+}
+
+/**
+ * Use the first IPv4 nameserver in `/etc/resolv.conf` as the resolver.
+ * Tiny builds read the file only the first time, stdio allocates.
+ * @param addr where to store the address.
+ * @return Zero if success, non-zero if no usable nameserver was found.
+ */
+int dns_default_server(struct sockaddr_in *addr) {
+#ifdef NETMON_TINY
+    static struct sockaddr_in server;
+    static int rv = -1, loaded = 0;
+    if (!loaded) {
+        loaded = 1;
+        rv = read_resolv_conf(&server);
+    }
+    if (rv == 0) *addr = server;
+    return rv;
+#else
+    return read_resolv_conf(addr);
+#endif
+}
+
+/**
+ * Parse a record type given by name (case-insensitive) or by number.
+ * @return The type, or -1 if unknown.
+ */
+int dns_parse_type(const char *s) {
+    static const struct {
+        const char *name;
+        int type;
+    } types[] = {
+            {"A",     DNS_TYPE_A},
+            {"NS",    DNS_TYPE_NS},
+            {"CNAME", DNS_TYPE_CNAME},
+            {"SOA",   DNS_TYPE_SOA},
+            {"MX",    DNS_TYPE_MX},
+            {"TXT",   DNS_TYPE_TXT},
+            {"AAAA",  DNS_TYPE_AAAA},
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (strcasecmp(s, types[i].name) == 0) return types[i].type;
+    }
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v <= 0 || v > 65535) return -1;
+    return (int) v;
+}
+
+/**
+ * Encode a recursive query in DNS wire format.
+ * @param buf the output buffer.
+ * @param buflen size of the output buffer.
+ * @param id the query id.
+ * @param name the domain name, with or without the trailing dot.
+ * @param qtype the record type.
+ * @return Length of the encoded query, or -1 if the name is invalid
+ * or the buffer is too small.
+ */
+int dns_encode_query(unsigned char *buf, size_t buflen, uint16_t id,
+                     const char *name, uint16_t qtype) {
+    size_t pos = DNS_HEADER_SIZE;
+    if (buflen < DNS_HEADER_SIZE + 5) return -1;
+    memset(buf, 0, DNS_HEADER_SIZE);
+    put16(buf, id);
+    buf[2] = 0x01; // RD
+    put16(buf + 4, 1); // QDCOUNT
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t len = dot ? (size_t) (dot - name) : strlen(name);
+        if (len == 0 || len > 63) return -1;
+        if (pos + 1 + len + 5 > buflen ||
+            pos + 1 + len - DNS_HEADER_SIZE > DNS_MAX_NAME - 1)
+            return -1;
+        buf[pos++] = (unsigned char) len;
+        memcpy(buf + pos, name, len);
+        pos += len;
+        name += len;
+        if (*name == '.') ++name;
+    }
+    if (pos == DNS_HEADER_SIZE) return -1; // root is not a useful probe
+    buf[pos++] = 0;
+    put16(buf + pos, qtype);
+    put16(buf + pos + 2, DNS_CLASS_IN);
+    return (int) (pos + 4);
+}
+
+/**
+ * Skip an encoded (possibly compressed) name.
+ * @return Offset right after the name, or 0 if malformed.
+ */
+static size_t skip_name(const unsigned char *buf, size_t len, size_t pos) {
+    while (pos < len) {
+        unsigned char b = buf[pos];
+        if (b == 0) return pos + 1;
+        if ((b & 0xC0) == 0xC0) return (pos + 2 <= len) ? pos + 2 : 0;
+        if (b & 0xC0) return 0; // reserved label types
+        pos += 1 + b;
+    }
+    return 0;
+}
+
+/**
+ * Parse a response, or the first len bytes of it if partial is set.
+ */
+static int parse_response(const unsigned char *buf, size_t len,
+                          const unsigned char *query, size_t query_len,
+                          struct dns_result *result, int partial) {
+    size_t qsec = query_len - DNS_HEADER_SIZE; // question section size
+    uint16_t qtype = get16(query + query_len - 4);
+    if (len < DNS_HEADER_SIZE) return -1;
+    if (get16(buf) != get16(query)) return DNS_MISMATCH;
+    if (!(buf[2] & 0x80)) return DNS_MISMATCH; // not a response
+    if (get16(buf + 4) != 1) return -1;
+    // the question must be echoed back; names are case-insensitive
+    if (len < query_len) return -1;
+    for (size_t i = 0; i < qsec; ++i) {
+        unsigned char a = buf[DNS_HEADER_SIZE + i],
+                b = query[DNS_HEADER_SIZE + i];
+        if (a != b && !(a >= 'A' && a <= 'Z' && a + 32 == b) &&
+            !(b >= 'A' && b <= 'Z' && b + 32 == a))
+            return DNS_MISMATCH;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->truncated = (buf[2] & 0x02) != 0;
+    result->rcode = buf[3] & 0x0F;
+    result->answers = get16(buf + 6);
+
+    size_t pos = query_len;
+    for (int i = 0; i < result->answers; ++i) {
+        pos = skip_name(buf, len, pos);
+        if (pos == 0 || pos + 10 > len) {
+            // a truncated reply may legally end in the middle of a record
+            if (result->truncated || partial) break;
+            return -1;
+        }
+        uint16_t type = get16(buf + pos);
+        uint16_t rdlen = get16(buf + pos + 8);
+        pos += 10 + rdlen;
+        if (pos > len) {
+            if (result->truncated || partial) break;
+            return -1;
+        }
+        if (type == qtype) ++result->matched;
+    }
+    return 0;
+}
+
+/**
+ * Parse a response and check it against the query it answers.
+ * @param buf the response.
+ * @param len length of the response.
+ * @param query the query we sent.
+ * @param query_len length of the query.
+ * @param result where to store the parsed result.
+ * @return Zero if the response answers our query, DNS_MISMATCH if it
+ * belongs to some other query, -1 if it is malformed.
+ */
+int dns_parse_response(const unsigned char *buf, size_t len,
+                       const unsigned char *query, size_t query_len,
+                       struct dns_result *result) {
+    return parse_response(buf, len, query, query_len, result, 0);
+}
+
+static int open_socket(void *logger, struct dns_probe *probe, int type) {
+    if ((probe->fd = socket(AF_INET, type, 0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    if (set_nonblocking(probe->fd)) {
+        perror("fcntl()");
+        log_error(logger, "fcntl() failed.");
+        return -1;
+    }
+    if (connect(probe->fd, (struct sockaddr *) &probe->server,
+                sizeof(probe->server)) < 0 && errno != EINPROGRESS) {
+        perror("connect()");
+        log_error(logger, "connect() to DNS server failed.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check the parsed result and finish the probe.
+ * @return Zero if the name resolved, -1 otherwise.
+ */
+static int finish(void *logger, struct dns_probe *probe) {
+    char buf[64];
+    probe->latency_us = elapsed_us(&probe->started);
+    probe->state = DNS_ST_DONE;
+    dns_probe_close(probe);
+    if (probe->result.rcode != DNS_RCODE_NOERROR) {
+        snprintf(buf, 63, "DNS server returned rcode %d.",
+                 probe->result.rcode);
+        log_error(logger, buf);
+        return -1;
+    }
+    if (probe->result.matched == 0) {
+        log_error(logger, "DNS response has no answer of the queried type.");
+        return -1;
+    }
+    snprintf(buf, 63, "DNS resolved in %ld us.", probe->latency_us);
+    log_debug(logger, buf);
+    return 0;
+}
+
+/**
+ * Start a DNS probe over UDP. This never blocks.
+ * @param logger the logger.
+ * @param probe the probe to be initialized.
+ * @param server the resolver.
+ * @param name the domain name to query.
+ * @param qtype the record type to query.
+ * @return Zero if the query is sent, non-zero if failed.
+ */
+int dns_probe_start(void *logger, struct dns_probe *probe,
+                    const struct sockaddr_in *server, const char *name,
+                    uint16_t qtype) {
+    NOTNULL(probe);
+    NOTNULL(server);
+    NOTNULL(name);
+    memset(probe, 0, sizeof(*probe));
+    probe->fd = -1;
+    probe->server = *server;
+    probe->qtype = qtype;
+    probe->id = next_id();
+    int len = dns_encode_query(probe->query, sizeof(probe->query), probe->id,
+                               name, qtype);
+    if (len < 0) {
+        log_error(logger, "Invalid DNS query name.");
+        return -1;
+    }
+    probe->query_len = (size_t) len;
+    clock_gettime(CLOCK_MONOTONIC, &probe->started);
+    if (open_socket(logger, probe, SOCK_DGRAM)) {
+        dns_probe_close(probe);
+        return -1;
+    }
+    if (send(probe->fd, probe->query, probe->query_len, 0) < 0) {
+        perror("send()");
+        log_error(logger, "send() DNS query failed.");
+        dns_probe_close(probe);
+        return -1;
+    }
+    probe->state = DNS_ST_UDP_WAIT;
+    return 0;
+}
+
+static int step_udp(void *logger, struct dns_probe *probe) {
+    while (1) {
+        ssize_t rd = recv(probe->fd, probe->response,
+                          sizeof(probe->response), 0);
+        if (rd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return DNS_PENDING;
+            // e.g. ECONNREFUSED from an ICMP port unreachable
+            perror("recv()");
+            log_error(logger, "recv() DNS response failed.");
+            return -1;
+        }
+        int r = dns_parse_response(probe->response, (size_t) rd,
+                                   probe->query, probe->query_len,
+                                   &probe->result);
+        if (r == DNS_MISMATCH) continue; // stale or spoofed, keep waiting
+        if (r < 0) {
+            log_error(logger, "Malformed DNS response.");
+            return -1;
+        }
+        if (!probe->result.truncated) return finish(logger, probe);
+        // answer does not fit into a datagram, retry over TCP
+        log_debug(logger, "DNS response is truncated. Retry with TCP.");
+        dns_probe_close(probe);
+        if (open_socket(logger, probe, SOCK_STREAM)) return -1;
+        probe->sent = probe->received = 0;
+        probe->state = DNS_ST_TCP_CONNECT;
+        return DNS_PENDING;
+    }
+}
+
+static int step_tcp(void *logger, struct dns_probe *probe) {
+    if (probe->state == DNS_ST_TCP_CONNECT) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 ||
+            err == EINPROGRESS)
+            return DNS_PENDING;
+        if (err) {
+            errno = err;
+            perror("connect()");
+            log_error(logger, "TCP connect() to DNS server failed.");
+            return -1;
+        }
+        probe->state = DNS_ST_TCP_SEND;
+    }
+    if (probe->state == DNS_ST_TCP_SEND) {
+        // message is prefixed with a two-byte length over TCP
+        unsigned char prefix[2];
+        put16(prefix, (uint16_t) probe->query_len);
+        while (probe->sent < probe->query_len + 2) {
+            const unsigned char *p = (probe->sent < 2) ?
+                                     prefix + probe->sent :
+                                     probe->query + probe->sent - 2;
+            size_t n = (probe->sent < 2) ?
+                       2 - probe->sent :
+                       probe->query_len + 2 - probe->sent;
+            ssize_t wr = send(probe->fd, p, n, MSG_NOSIGNAL);
+            if (wr < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return DNS_PENDING;
+                perror("send()");
+                log_error(logger, "send() DNS query over TCP failed.");
+                return -1;
+            }
+            probe->sent += (size_t) wr;
+        }
+        probe->state = DNS_ST_TCP_RECV;
+    }
+    // state == DNS_ST_TCP_RECV
+    // the length prefix is stored in response[0..1], the message follows
+    // it. A message may be up to 64 KiB, only the part that fits is kept:
+    // header, question and the first answers are all the check looks at
+    while (1) {
+        unsigned char discard[256];
+        unsigned char *dst = discard;
+        size_t want = 2, n;
+        if (probe->received >= 2) {
+            want = 2 + (size_t) get16(probe->response);
+            if (probe->received == want) break;
+        }
+        n = want - probe->received;
+        if (probe->received < sizeof(probe->response)) {
+            dst = probe->response + probe->received;
+            if (n > sizeof(probe->response) - probe->received)
+                n = sizeof(probe->response) - probe->received;
+        } else if (n > sizeof(discard)) {
+            n = sizeof(discard);
+        }
+        ssize_t rd = recv(probe->fd, dst, n, 0);
+        if (rd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return DNS_PENDING;
+            perror("recv()");
+            log_error(logger, "recv() DNS response over TCP failed.");
+            return -1;
+        }
+        if (rd == 0) {
+            log_error(logger, "DNS server closed the TCP connection.");
+            return -1;
+        }
+        probe->received += (size_t) rd;
+    }
+    int partial = probe->received > sizeof(probe->response);
+    size_t kept = partial ? sizeof(probe->response) : probe->received;
+    int r = parse_response(probe->response + 2, kept - 2, probe->query,
+                           probe->query_len, &probe->result, partial);
+    if (r != 0) {
+        log_error(logger, "Malformed DNS response over TCP.");
+        return -1;
+    }
+    return finish(logger, probe);
+}
+
+/**
+ * Make progress on a probe without blocking. Call this whenever the
+ * probe's socket becomes ready for dns_probe_events().
+ * @return DNS_PENDING if not finished yet, zero if the name is resolved,
+ * -1 if failed. The socket is closed once the probe is finished.
+ */
+int dns_probe_step(void *logger, struct dns_probe *probe) {
+    int rv;
+    switch (probe->state) {
+        case DNS_ST_UDP_WAIT:
+            rv = step_udp(logger, probe);
+            break;
+        case DNS_ST_TCP_CONNECT:
+        case DNS_ST_TCP_SEND:
+        case DNS_ST_TCP_RECV:
+            rv = step_tcp(logger, probe);
+            break;
+        default:
+            return -1;
+    }
+    if (rv < 0) {
+        probe->state = DNS_ST_DONE;
+        dns_probe_close(probe);
+    }
+    return rv;
+}
+
+/**
+ * @return The poll() events the probe is waiting for.
+ */
+short dns_probe_events(const struct dns_probe *probe) {
+    switch (probe->state) {
+        case DNS_ST_TCP_CONNECT:
+        case DNS_ST_TCP_SEND:
+            return POLLOUT;
+        case DNS_ST_UDP_WAIT:
+        case DNS_ST_TCP_RECV:
+            return POLLIN;
+        default:
+            return 0;
+    }
+}
+
+void dns_probe_close(struct dns_probe *probe) {
+    if (probe->fd >= 0) close(probe->fd);
+    probe->fd = -1;
+}
+
+/**
+ * Check network availability by resolving a domain name.
+ * @param logger the logger.
+ * @param probe storage for the query state. It is large, so callers keep
+ * it off the stack.
+ * @param server the resolver.
+ * @param name the domain name to query.
+ * @param qtype the record type to query.
+ * @param latency_us if not null, store the resolution latency here.
+ * @return Zero if success, non-zero if failed.
+ */
+int check_dns(void *logger, struct dns_probe *probe,
+              const struct sockaddr_in *server, const char *name,
+              uint16_t qtype, long *latency_us) {
+    int rv;
+    if (dns_probe_start(logger, probe, server, name, qtype)) return -1;
+    while ((rv = dns_probe_step(logger, probe)) == DNS_PENDING) {
+        long left = DNS_TIMEOUT_MS - elapsed_us(&probe->started) / 1000;
+        struct pollfd pfd = {probe->fd, dns_probe_events(probe), 0};
+        if (left <= 0 || poll(&pfd, 1, (int) left) == 0) {
+            log_error(logger, "DNS query timed out.");
+            dns_probe_close(probe);
+            return -1;
+        }
+    }
+    if (rv == 0 && latency_us) *latency_us = probe->latency_us;
+    return rv;
+}
@@ -0,0 +1,110 @@
+//
+// Created by Keuin on 2022/1/8.
+//
+
+#ifndef NETMON_DNS_H
+#define NETMON_DNS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define DNS_PORT 53
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_NAME 255
+// header + qname + qtype + qclass
+#define DNS_MAX_QUERY (DNS_HEADER_SIZE + DNS_MAX_NAME + 4)
+// part of a reply that is kept. Larger replies over TCP, up to 64 KiB,
+// are read to the end and parsed as far as they fit
+#define DNS_MAX_RESPONSE 4096
+// timeout of a blocking DNS check, in milliseconds
+#define DNS_TIMEOUT_MS 5000
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_NS 2
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_MX 15
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+// returned by dns_probe_step() when the probe has not finished yet
+#define DNS_PENDING 1
+// returned by dns_parse_response() when the datagram is not our reply
+#define DNS_MISMATCH 1
+
+enum dns_probe_state {
+    DNS_ST_IDLE = 0,
+    DNS_ST_UDP_WAIT,
+    DNS_ST_TCP_CONNECT,
+    DNS_ST_TCP_SEND,
+    DNS_ST_TCP_RECV,
+    DNS_ST_DONE,
+};
+
+struct dns_result {
+    int rcode;
+    int truncated;
+    // total records in answer section
+    int answers;
+    // answer records whose type equals the queried type
+    int matched;
+};
+
+/**
+ * A single in-flight DNS query. All buffers are inline, so a probe
+ * never allocates memory and can be embedded in any other structure.
+ */
+struct dns_probe {
+    enum dns_probe_state state;
+    int fd;
+    uint16_t id;
+    uint16_t qtype;
+    struct sockaddr_in server;
+    unsigned char query[DNS_MAX_QUERY];
+    size_t query_len;
+    // TCP: bytes of (length prefix + query) sent so far
+    size_t sent;
+    unsigned char response[DNS_MAX_RESPONSE];
+    // TCP: bytes of (length prefix + response) received so far
+    size_t received;
+    struct timespec started;
+    struct dns_result result;
+    // resolution latency in microseconds, valid after a successful probe
+    long latency_us;
+};
+
+int dns_parse_server(const char *s, struct sockaddr_in *addr);
+
+int dns_default_server(struct sockaddr_in *addr);
+
+int dns_parse_type(const char *s);
+
+int dns_encode_query(unsigned char *buf, size_t buflen, uint16_t id,
+                     const char *name, uint16_t qtype);
+
+int dns_parse_response(const unsigned char *buf, size_t len,
+                       const unsigned char *query, size_t query_len,
+                       struct dns_result *result);
+
+int dns_probe_start(void *logger, struct dns_probe *probe,
+                    const struct sockaddr_in *server, const char *name,
+                    uint16_t qtype);
+
+int dns_probe_step(void *logger, struct dns_probe *probe);
+
+short dns_probe_events(const struct dns_probe *probe);
+
+void dns_probe_close(struct dns_probe *probe);
+
+int check_dns(void *logger, struct dns_probe *probe,
+              const struct sockaddr_in *server, const char *name,
+              uint16_t qtype, long *latency_us);
+
+#endif //NETMON_DNS_H
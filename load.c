@@ -0,0 +1,406 @@
+//
+// Created by Keuin on 2022/1/19.
+//
+// Latency under load: sample the RTT to a sink while the link is idle,
+// then again while parallel TCP streams saturate it, and report how much
+// the queues along the way inflate the latency (bufferbloat).
+//
+// RTT is sampled with UDP echo packets (see udpecho.h), which the sink
+// reflects. The streams send from a zero-filled memfd with sendfile(),
+// and the sink discards with MSG_TRUNC, so neither side copies payload
+// and the link is measured rather than our CPU.
+//
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+#include "arena.h"
+#include "load.h"
+#include "logging.h"
+#include "udpecho.h"
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @return Bytes the load generator will allocate from the arena.
+ */
+size_t load_footprint(void) {
+    return sizeof(struct load);
+}
+
+/**
+ * Prepare the load generator.
+ * @param logger the logger.
+ * @param l the generator.
+ * @param sink where the sink (another netmon started with `--sink`) is.
+ * @param streams parallel TCP streams.
+ * @param duration seconds the streams run for.
+ * @return Zero if success, non-zero if failed.
+ */
+int load_init(void *logger, struct load *l, const struct sockaddr_in *sink,
+              unsigned int streams, unsigned int duration) {
+    memset(l, 0, sizeof(*l));
+    l->sink = *sink;
+    l->streams = streams;
+    l->duration = duration;
+    for (int i = 0; i < LOAD_MAX_STREAMS; ++i) l->fds[i] = -1;
+    // a hole reads as zeros without taking any memory
+    if ((l->src = memfd_create("netmon-load", MFD_CLOEXEC)) < 0 ||
+        ftruncate(l->src, LOAD_CHUNK) < 0) {
+        perror("memfd_create()");
+        log_error(logger, "Cannot create the source of the load.");
+        return -1;
+    }
+    return 0;
+}
+
+static void open_streams(struct load *l) {
+    for (unsigned i = 0; i < l->streams; ++i) {
+        // abort on close, so nothing keeps loading the link afterwards
+        struct linger lg = {1, 0};
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        l->sent[i] = 0;
+        l->fds[i] = fd;
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        if (connect(fd, (const struct sockaddr *) &l->sink,
+                    sizeof(l->sink)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            l->fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Close the streams.
+ * @return Bytes the sink acknowledged.
+ */
+static uint64_t close_streams(struct load *l) {
+    uint64_t acked = 0;
+    for (unsigned i = 0; i < l->streams; ++i) {
+        int outq = 0;
+        if (l->fds[i] < 0) continue;
+        // not yet acknowledged bytes are still in the send queue
+        if (ioctl(l->fds[i], SIOCOUTQ, &outq) == 0 &&
+            (uint64_t) outq <= l->sent[i])
+            acked += l->sent[i] - (uint64_t) outq;
+        close(l->fds[i]);
+        l->fds[i] = -1;
+    }
+    return acked;
+}
+
+static void push(struct load *l, unsigned i) {
+    off_t off = 0;
+    ssize_t n = sendfile(l->fds[i], l->src, &off, LOAD_CHUNK);
+    if (n > 0) {
+        l->sent[i] += (uint64_t) n;
+    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+               errno != EINTR) {
+        // refused or reset, the other streams carry on
+        close(l->fds[i]);
+        l->fds[i] = -1;
+    }
+}
+
+static void send_probe(int sock, uint32_t seq) {
+    struct udp_echo_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.magic = htonl(UDP_ECHO_MAGIC);
+    pkt.seq = htonl(seq);
+    // the sink sends it back untouched and no one-way delay is taken, so
+    // the send time is on our monotonic clock, unlike the UDP echo check
+    pkt.t1 = htobe64((uint64_t) monotonic_us());
+    send(sock, &pkt, sizeof(pkt), 0);
+}
+
+/**
+ * Take the replies that arrived, filing each under the phase it was
+ * sent in.
+ * @return Replies taken.
+ */
+static uint32_t take_replies(struct load *l, int sock, uint32_t sent,
+                             uint32_t idle_seqs, uint32_t ramp_seqs) {
+    struct udp_echo_packet pkt;
+    uint32_t n = 0;
+    while (recv(sock, &pkt, sizeof(pkt), MSG_DONTWAIT) == sizeof(pkt)) {
+        uint32_t seq = ntohl(pkt.seq);
+        if (ntohl(pkt.magic) != UDP_ECHO_MAGIC || seq >= sent) continue;
+        long rtt = (long) (monotonic_us() - (long long) be64toh(pkt.t1));
+        ++n;
+        if (seq < idle_seqs) {
+            if (l->n_idle < LOAD_MAX_SAMPLES) l->idle[l->n_idle++] = rtt;
+        } else if (seq >= ramp_seqs) {
+            if (l->n_loaded < LOAD_MAX_SAMPLES) l->loaded[l->n_loaded++] = rtt;
+        }
+    }
+    return n;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(long *samples, uint32_t n, int pct) {
+    if (n == 0) return -1;
+    return samples[(uint64_t) n * (unsigned) pct / 100];
+}
+
+/**
+ * Format a result in one line.
+ */
+void load_format(const struct load_result *r, char *buf, size_t len) {
+    snprintf(buf, len, "idle p50 %ld us p90 %ld us, loaded p50 %ld us "
+                       "p90 %ld us, inflation %ld us, throughput %.2f Mbit/s, "
+                       "probes %u lost %u",
+             r->idle_p50, r->idle_p90, r->loaded_p50, r->loaded_p90,
+             r->inflation_us, r->throughput_bps / 1e6, r->probes, r->lost);
+}
+
+/**
+ * Measure latency under load once. Takes LOAD_IDLE_MS plus the duration,
+ * and blocks meanwhile except for l->serve.
+ * @param logger the logger.
+ * @param l the generator, its result is stored in l->last.
+ * @return Zero if success, non-zero if the sink cannot be reached.
+ */
+int load_run(void *logger, struct load *l) {
+    struct load_result r;
+    uint32_t seq = 0, skipped = 0, received = 0, served = 0;
+    int sock, opened = 0, cut = 0;
+    memset(&r, 0, sizeof(r));
+    // l->last is shown by `status` while this runs, it is replaced at the end
+    r.when = time(NULL);
+    l->n_idle = l->n_loaded = 0;
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(sock, (const struct sockaddr *) &l->sink, sizeof(l->sink)) < 0) {
+        perror("socket()");
+        log_error(logger, "Cannot open the RTT probe socket.");
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+
+    const long long gap = LOAD_PROBE_MS * 1000LL;
+    long long start = monotonic_us();
+    long long load_start = start + LOAD_IDLE_MS * 1000LL;
+    long long end = load_start + (long long) l->duration * 1000000LL;
+    // probe number i is due at start + i * gap
+    uint32_t idle_seqs = LOAD_IDLE_MS * 1000LL / gap;
+    uint32_t ramp_seqs = idle_seqs + (uint32_t) (LOAD_RAMP_MS * 1000LL / gap);
+    log_debug(logger, "Measuring latency under load.");
+    while (1) {
+        long long now = monotonic_us();
+        if (now >= end) break;
+        if (!opened && now >= load_start) {
+            open_streams(l);
+            opened = 1;
+        }
+        // if we fall behind, skip probes instead of sending a burst
+        while (start + (long long) seq * gap <= now) {
+            if (start + (long long) (seq + 1) * gap > now) send_probe(sock, seq);
+            else ++skipped;
+            ++seq;
+        }
+        if (l->serve && served != seq) {
+            served = seq;
+            if (l->serve(l->serve_arg)) {
+                log_info(logger, "Measuring latency under load is cut short.");
+                cut = 1;
+                end = now;
+                break;
+            }
+        }
+        struct pollfd pfds[1 + LOAD_MAX_STREAMS];
+        pfds[0] = (struct pollfd) {sock, POLLIN, 0};
+        for (unsigned i = 0; i < l->streams; ++i) {
+            pfds[1 + i] = (struct pollfd) {opened ? l->fds[i] : -1, POLLOUT, 0};
+        }
+        long long wake = start + (long long) seq * gap;
+        if (!opened && load_start < wake) wake = load_start;
+        if (end < wake) wake = end;
+        if (poll(pfds, 1 + l->streams, (int) ((wake - now + 999) / 1000)) <= 0)
+            continue;
+        if (pfds[0].revents)
+            received += take_replies(l, sock, seq, idle_seqs, ramp_seqs);
+        for (unsigned i = 0; i < l->streams; ++i) {
+            if (l->fds[i] >= 0 && pfds[1 + i].revents) push(l, i);
+        }
+    }
+    uint64_t acked = close_streams(l);
+    // the last replies are still on their way back, and not slowed down
+    // by the streams any more
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (received < seq - skipped && poll(&pfd, 1, 4 * LOAD_PROBE_MS) > 0)
+        received += take_replies(l, sock, seq, idle_seqs, ramp_seqs);
+    close(sock);
+
+    r.probes = seq - skipped;
+    r.lost = r.probes - received;
+    qsort(l->idle, l->n_idle, sizeof(long), cmp_long);
+    qsort(l->loaded, l->n_loaded, sizeof(long), cmp_long);
+    r.idle_p50 = percentile(l->idle, l->n_idle, 50);
+    r.idle_p90 = percentile(l->idle, l->n_idle, 90);
+    r.loaded_p50 = percentile(l->loaded, l->n_loaded, 50);
+    r.loaded_p90 = percentile(l->loaded, l->n_loaded, 90);
+    r.inflation_us = (r.idle_p50 >= 0 && r.loaded_p50 >= 0) ?
+                     r.loaded_p50 - r.idle_p50 : -1;
+    if (end > load_start)
+        r.throughput_bps = (double) acked * 8 * 1e6 / (double) (end - load_start);
+    l->last = r;
+
+    char buf[256];
+    if (cut) return -1;
+    if (acked == 0) {
+        log_error(logger, "No data reached the load sink.");
+        return -1;
+    }
+    snprintf(buf, sizeof(buf), "Latency under load: ");
+    load_format(&r, buf + strlen(buf), sizeof(buf) - strlen(buf));
+    log_info(logger, buf);
+    return 0;
+}
+
+struct sink {
+    int tcp, udp;
+    int clients[LOAD_SINK_CLIENTS];
+};
+
+/**
+ * @return Bytes the sink will allocate from the arena.
+ */
+size_t sink_footprint(void) {
+    return sizeof(struct sink);
+}
+
+static int open_sink(void *logger, struct sink *s, uint16_t port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((s->udp = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+        (s->tcp = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    setsockopt(s->tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(s->udp, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        bind(s->tcp, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        log_error(logger, "bind() failed.");
+        return -1;
+    }
+    if (listen(s->tcp, LOAD_SINK_CLIENTS) < 0) {
+        perror("listen()");
+        log_error(logger, "listen() failed.");
+        return -1;
+    }
+    return 0;
+}
+
+static void reflect(int sock) {
+    struct udp_echo_packet pkt;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    ssize_t rd;
+    while ((rd = recvfrom(sock, &pkt, sizeof(pkt), MSG_DONTWAIT,
+                          (struct sockaddr *) &from, &len)) >= 0) {
+        if ((size_t) rd == sizeof(pkt) && ntohl(pkt.magic) == UDP_ECHO_MAGIC) {
+            pkt.t2 = htobe64(realtime_ns());
+            pkt.t3 = pkt.t2;
+            sendto(sock, &pkt, sizeof(pkt), MSG_DONTWAIT,
+                   (struct sockaddr *) &from, len);
+        }
+        len = sizeof(from);
+    }
+}
+
+static void discard(int *fd) {
+    ssize_t rd;
+    // MSG_TRUNC makes TCP drop the data without copying it out
+    while ((rd = recv(*fd, NULL, 1 << 20, MSG_TRUNC | MSG_DONTWAIT)) > 0);
+    if (rd == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/**
+ * Run as a load sink: discard TCP streams, and reflect UDP echo packets
+ * on the same port. Never returns unless failed.
+ * @param logger the logger.
+ * @param port the port.
+ * @return Non-zero if failed.
+ */
+int sink_run(void *logger, uint16_t port) {
+    struct sink *s = arena_alloc(sizeof(struct sink));
+    if (!s) {
+        log_error(logger, "Cannot allocate the sink.");
+        return -1;
+    }
+    if (open_sink(logger, s, port)) return -1;
+    for (int i = 0; i < LOAD_SINK_CLIENTS; ++i) s->clients[i] = -1;
+
+    char buf[64];
+    snprintf(buf, 63, "Sink is listening on port %u.", port);
+    log_info(logger, buf);
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "EndlessLoop"
+    while (1) {
+        struct pollfd pfds[2 + LOAD_SINK_CLIENTS];
+        pfds[0] = (struct pollfd) {s->udp, POLLIN, 0};
+        pfds[1] = (struct pollfd) {s->tcp, POLLIN, 0};
+        for (int i = 0; i < LOAD_SINK_CLIENTS; ++i) {
+            pfds[2 + i] = (struct pollfd) {s->clients[i], POLLIN, 0};
+        }
+        if (poll(pfds, 2 + LOAD_SINK_CLIENTS, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll()");
+            log_error(logger, "poll() failed.");
+            return -1;
+        }
+        // probes first, they must not wait behind the streams
+        if (pfds[0].revents) reflect(s->udp);
+        if (pfds[1].revents) {
+            int fd = accept4(s->tcp, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            for (int i = 0; fd >= 0 && i < LOAD_SINK_CLIENTS; ++i) {
+                if (s->clients[i] < 0) {
+                    s->clients[i] = fd;
+                    fd = -1;
+                }
+            }
+            if (fd >= 0) close(fd); // too many streams at once
+        }
+        for (int i = 0; i < LOAD_SINK_CLIENTS; ++i) {
+            if (s->clients[i] >= 0 && pfds[2 + i].revents)
+                discard(&s->clients[i]);
+        }
+    }
+#pragma clang diagnostic pop
+}
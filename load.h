@@ -0,0 +1,84 @@
+//
+// Created by Keuin on 2022/1/19.
+//
+
+#ifndef NETMON_LOAD_H
+#define NETMON_LOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define LOAD_DEFAULT_PORT 8621
+#define LOAD_DEFAULT_STREAMS 4
+#define LOAD_MAX_STREAMS 16
+// seconds the streams run for by default, and at most
+#define LOAD_DEFAULT_DURATION 10
+#define LOAD_MAX_DURATION 60
+// RTT of the idle link is sampled this long before the streams start
+#define LOAD_IDLE_MS 2000
+// loaded RTT is sampled only after the streams ramped up for this long
+#define LOAD_RAMP_MS 1000
+// one RTT sample every this many milliseconds
+#define LOAD_PROBE_MS 20
+#define LOAD_MAX_SAMPLES ((LOAD_IDLE_MS + LOAD_MAX_DURATION * 1000) / \
+                          LOAD_PROBE_MS)
+// bytes offered to the kernel by one sendfile() call
+#define LOAD_CHUNK (256 * 1024)
+// connections the sink serves at once
+#define LOAD_SINK_CLIENTS 64
+
+struct load_result {
+    // wall clock time of the measurement, 0 if none yet
+    time_t when;
+    // RTT percentiles in microseconds, -1 if no sample
+    long idle_p50;
+    long idle_p90;
+    long loaded_p50;
+    long loaded_p90;
+    // loaded minus idle median RTT
+    long inflation_us;
+    // bytes acknowledged by the sink per second, in bits
+    double throughput_bps;
+    uint32_t probes;
+    uint32_t lost;
+};
+
+/**
+ * State of the load generator. Samples are kept inline, so a measurement
+ * never allocates.
+ */
+struct load {
+    struct sockaddr_in sink;
+    unsigned int streams;
+    unsigned int duration;
+    // zero-filled file the streams send from
+    int src;
+    int fds[LOAD_MAX_STREAMS];
+    uint64_t sent[LOAD_MAX_STREAMS];
+    uint32_t n_idle, n_loaded;
+    long idle[LOAD_MAX_SAMPLES];
+    long loaded[LOAD_MAX_SAMPLES];
+    struct load_result last;
+    // called once per RTT probe while measuring, to serve other sockets
+    // meanwhile. Returns non-zero to cut the measurement short. NULL if
+    // not used
+    int (*serve)(void *arg);
+    void *serve_arg;
+};
+
+size_t load_footprint(void);
+
+int load_init(void *logger, struct load *l, const struct sockaddr_in *sink,
+              unsigned int streams, unsigned int duration);
+
+int load_run(void *logger, struct load *l);
+
+void load_format(const struct load_result *r, char *buf, size_t len);
+
+size_t sink_footprint(void);
+
+int sink_run(void *logger, uint16_t port);
+
+#endif //NETMON_LOAD_H
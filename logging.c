@@ -3,18 +3,291 @@
 //
 
 #include "logging.h"
+#include "arena.h"
 #include "validate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+// messages remembered to detect repeated cycles, at least twice the
+// longest cycle
+#define LOG_HISTORY (LOG_CYCLE_MAX * 2)
+// max length of a remembered message
+#define LOG_MSG_MAX 192
+// max length of the log file path if rotation is enabled
+#define LOG_PATH_MAX 512
 
+struct log_entry {
+    uint64_t hash;
+    const char *level;
+    const char *filename;
+    int lineno;
+    char msg[LOG_MSG_MAX];
+};
+
+// Lines are formatted into a buffer owned by the logger and written with
+// a single write(2), so logging never touches stdio or the heap.
+struct logger {
+    int fd;
+    const char *filename;
+    struct log_options opt;
+    off_t size;
+    time_t opened;
+    // pid of the running compressor, or 0
+    pid_t compressor;
+
+    // the last messages, in a ring
+    struct log_entry history[LOG_HISTORY];
+    unsigned long count;
+    // length of the cycle being suppressed, 0 if not suppressing
+    int period;
+    unsigned long suppressed;
+    time_t suppress_since;
+
+    char line[LOG_LINE_MAX];
+    char path[LOG_PATH_MAX];
+    char path2[LOG_PATH_MAX];
+};
+
+static volatile sig_atomic_t reopen_requested = 0;
+
+/**
+ * @return Bytes the logger will allocate from the arena.
+ */
+size_t log_footprint(void) {
+    return sizeof(struct logger);
+}
+
+static int open_file(struct logger *lg) {
+    struct stat st;
+    if (lg->filename == NULL) {
+        // discard everything
+        lg->fd = -1;
+        return 0;
+    }
+    lg->fd = open(lg->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (lg->fd < 0) return -1;
+    lg->size = (fstat(lg->fd, &st) == 0) ? st.st_size : 0;
+    lg->opened = time(NULL);
+    return 0;
+}
+
+/**
+ * Create a logger. If filename is NULL, messages only go to stderr.
+ */
 void *log_init(const char *filename) {
-    FILE *fp = fopen(filename, "a");
-    return fp;
+    struct logger *lg = arena_alloc(sizeof(struct logger));
+    if (!lg) return NULL;
+    lg->filename = filename;
+    lg->opt.mirror_stderr = 1;
+    if (open_file(lg)) return NULL;
+    return lg;
+}
+
+void log_set_options(void *logger, const struct log_options *opt) {
+    struct logger *lg = logger;
+    lg->opt = *opt;
+    if (lg->filename == NULL || strlen(lg->filename) + 16 > LOG_PATH_MAX) {
+        // no room for the suffix of rotated files
+        lg->opt.max_size = lg->opt.max_age = 0;
+    }
+}
+
+/**
+ * Ask all loggers to reopen their files at the next message, e.g. after
+ * they were moved away by logrotate. Safe to call from a signal handler.
+ */
+void log_request_reopen(void) {
+    reopen_requested = 1;
+}
+
+static void write_line(struct logger *lg, const char *level, time_t ts,
+                       const char *filename, int lineno, const char *msg) {
+    char timestr[32];
+    struct tm tm;
+    strftime(timestr, 31, "%Y-%m-%d %H:%M:%S", localtime_r(&ts, &tm));
+    int len = snprintf(lg->line, LOG_LINE_MAX, "[%s][%s][%s][%d] %s\n",
+                       timestr, level, filename, lineno, msg);
+    if (len <= 0) return;
+    if (len >= LOG_LINE_MAX) {
+        // keep the line terminated even if it is truncated
+        len = LOG_LINE_MAX - 1;
+        lg->line[len - 1] = '\n';
+    }
+    if (lg->fd >= 0 && write(lg->fd, lg->line, (size_t) len) > 0) {
+        lg->size += len;
+    }
+    if (lg->opt.mirror_stderr &&
+        write(STDERR_FILENO, lg->line, (size_t) len) < 0) {
+        // stderr may be closed when running as a daemon
+    }
+}
+
+static void reap_compressor(struct logger *lg) {
+    if (lg->compressor > 0 && waitpid(lg->compressor, NULL, WNOHANG) != 0)
+        lg->compressor = 0;
+}
+
+/**
+ * Compress the newest rotated file in a child process, so the monitor
+ * is never blocked by it.
+ */
+static void compress_rotated(struct logger *lg) {
+    snprintf(lg->path, LOG_PATH_MAX, "%s.1", lg->filename);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("gzip", "gzip", "-f", lg->path, (char *) NULL);
+        _exit(127);
+    }
+    if (pid > 0) lg->compressor = pid;
+}
+
+/**
+ * Rotate: file.(n-1) -> file.n, ..., file -> file.1, then reopen file.
+ */
+static void rotate(struct logger *lg) {
+    // the compressor still works on file.1, try again later
+    reap_compressor(lg);
+    if (lg->compressor > 0) return;
+    for (int i = lg->opt.keep; i >= 1; --i) {
+        for (int gz = 0; gz <= 1; ++gz) {
+            const char *ext = gz ? ".gz" : "";
+            if (i == 1 && gz) break;
+            if (i == 1) snprintf(lg->path, LOG_PATH_MAX, "%s", lg->filename);
+            else snprintf(lg->path, LOG_PATH_MAX, "%s.%d%s",
+                          lg->filename, i - 1, ext);
+            snprintf(lg->path2, LOG_PATH_MAX, "%s.%d%s",
+                     lg->filename, i, ext);
+            if (rename(lg->path, lg->path2) < 0 && errno != ENOENT) {
+                // leave everything as is and keep writing to the old file
+                return;
+            }
+        }
+    }
+    if (lg->opt.keep <= 0) unlink(lg->filename);
+    int old = lg->fd;
+    if (open_file(lg)) {
+        lg->fd = old; // keep logging somewhere
+        return;
+    }
+    if (old >= 0) close(old);
+    if (lg->opt.compress && lg->opt.keep > 0) compress_rotated(lg);
+}
+
+static void maybe_rotate(struct logger *lg, time_t now) {
+    if ((lg->opt.max_size > 0 && lg->size >= lg->opt.max_size) ||
+        (lg->opt.max_age > 0 && now - lg->opened >= lg->opt.max_age))
+        rotate(lg);
+}
+
+/**
+ * Hash the source of a message and its exact text. Lines reporting an RTT
+ * or a counter repeat only while the value stays the same, so no value
+ * ever hides behind a "repeated N times" summary.
+ */
+static uint64_t hash_message(const char *level, const char *filename,
+                             int lineno, const char *msg) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = level; *p; ++p) h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    for (const char *p = filename; *p; ++p) h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    h = (h ^ (uint64_t) lineno) * 1099511628211ULL;
+    for (const char *p = msg; *p; ++p) h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    return h;
+}
+
+static const struct log_entry *recent(const struct logger *lg, int back) {
+    return &lg->history[(lg->count - (unsigned long) back) % LOG_HISTORY];
+}
+
+/**
+ * Write the summary of suppressed messages, followed by those of an
+ * incomplete cycle so that no message is lost.
+ */
+static void flush_suppressed(struct logger *lg, time_t ts) {
+    if (lg->period == 0 || lg->suppressed == 0) return;
+    unsigned long cycles = lg->suppressed / (unsigned long) lg->period;
+    int rest = (int) (lg->suppressed % (unsigned long) lg->period);
+    if (cycles > 0) {
+        char buf[96];
+        if (lg->period == 1) {
+            snprintf(buf, sizeof(buf), "Last message repeated %lu times.",
+                     cycles);
+        } else {
+            snprintf(buf, sizeof(buf), "Last %d messages repeated %lu times.",
+                     lg->period, cycles);
+        }
+        write_line(lg, "INFO", ts, __FILE__, __LINE__, buf);
+    }
+    for (int i = rest; i >= 1; --i) {
+        const struct log_entry *e = recent(lg, i);
+        write_line(lg, e->level, ts, e->filename, e->lineno, e->msg);
+    }
+    lg->suppressed = 0;
+    lg->suppress_since = ts;
+}
+
+/**
+ * Remember a message and decide whether it continues a repeated cycle.
+ * @return Non-zero if the message should be suppressed.
+ */
+static int coalesce(struct logger *lg, const char *level, time_t ts,
+                    const char *filename, int lineno, const char *msg) {
+    uint64_t h = hash_message(level, filename, lineno, msg);
+    int suppress = 0;
+    if (lg->period > 0) {
+        if (h == recent(lg, lg->period)->hash) {
+            suppress = 1;
+        } else {
+            flush_suppressed(lg, ts);
+            lg->period = 0;
+        }
+    }
+    if (lg->period == 0) {
+        // look for the shortest cycle the last messages repeat with
+        for (int p = 1; p <= LOG_CYCLE_MAX && !suppress; ++p) {
+            if ((unsigned long) (2 * p - 1) > lg->count) break;
+            if (h != recent(lg, p)->hash) continue;
+            int i = 1;
+            while (i < p && recent(lg, i)->hash == recent(lg, i + p)->hash)
+                ++i;
+            if (i == p) {
+                lg->period = p;
+                lg->suppressed = 0;
+                lg->suppress_since = ts;
+                suppress = 1;
+            }
+        }
+    }
+    struct log_entry *e = &lg->history[lg->count % LOG_HISTORY];
+    e->hash = h;
+    e->level = level;
+    e->filename = filename;
+    e->lineno = lineno;
+    strncpy(e->msg, msg, LOG_MSG_MAX - 1);
+    e->msg[LOG_MSG_MAX - 1] = '\0';
+    ++lg->count;
+    if (suppress) {
+        ++lg->suppressed;
+        // let a summary out now and then, so the log shows we are alive
+        if (ts - lg->suppress_since >= LOG_REPEAT_FLUSH &&
+            lg->suppressed % (unsigned long) lg->period == 0)
+            flush_suppressed(lg, ts);
+    }
+    return suppress;
 }
 
 void log_free(void *logger) {
-    fflush(logger);
-    fclose(logger);
+    struct logger *lg = logger;
+    flush_suppressed(lg, time(NULL));
+    if (lg->fd >= 0) close(lg->fd);
+    lg->fd = -1;
 }
 
 void log_print(void *logger, const char *level, time_t ts, const char *filename,
@@ -23,12 +296,18 @@ void log_print(void *logger, const char *level, time_t ts, const char *filename,
     NOTNULL(level);
     NOTNULL(filename);
     NOTNULL(msg);
-    char timestr[32];
-    strftime(timestr, 31, "%Y-%m-%d %H:%M:%S", localtime(&ts));
-    if (fprintf(logger, "[%s][%s][%s][%d] %s\n", timestr, level, filename,
-                lineno, msg))
-        fflush(logger);
-    if (fprintf(stderr, "[%s][%s][%s][%d] %s\n", timestr, level, filename,
-                lineno, msg))
-        fflush(stderr);
+    struct logger *lg = logger;
+    if (reopen_requested) {
+        reopen_requested = 0;
+        int old = lg->fd;
+        if (open_file(lg) == 0) {
+            if (old >= 0) close(old);
+        } else {
+            lg->fd = old;
+        }
+    }
+    reap_compressor(lg);
+    if (coalesce(lg, level, ts, filename, lineno, msg)) return;
+    write_line(lg, level, ts, filename, lineno, msg);
+    maybe_rotate(lg, ts);
 }
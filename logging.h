@@ -5,16 +5,43 @@
 #ifndef NETMON_LOGGING_H
 #define NETMON_LOGGING_H
 
+#include <stddef.h>
 #include <time.h>
 
+// max length of a formatted log line, including the newline
+#define LOG_LINE_MAX 512
+// longest cycle of messages coalesced into a "repeated N times" line
+#define LOG_CYCLE_MAX 8
+// seconds between two summaries of a long-running repetition
+#define LOG_REPEAT_FLUSH 3600
+
+struct log_options {
+    // also write to stderr
+    int mirror_stderr;
+    // rotate if the file grows to this many bytes, 0 to disable
+    long max_size;
+    // rotate if the file is older than this many seconds, 0 to disable
+    long max_age;
+    // rotated files to keep
+    int keep;
+    // gzip rotated files in background
+    int compress;
+};
+
 #define die(args...) \
     do { \
         fprintf(stderr, args); \
         exit(1); \
     } while(0)
 
+size_t log_footprint(void);
+
 void *log_init(const char *filename);
 
+void log_set_options(void *logger, const struct log_options *opt);
+
+void log_request_reopen(void);
+
 void log_free(void *logger);
 
 void log_print(void *logger, const char *level, time_t ts, const char *filename,
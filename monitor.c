@@ -0,0 +1,235 @@
+//
+// Created by Keuin on 2022/1/12.
+//
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "control.h"
+#include "logging.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "validate.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * Ask the monitor to return from monitor_run() once the current check
+ * is done. Safe to call from a signal handler.
+ */
+void monitor_request_stop(void) {
+    stop_requested = 1;
+}
+
+int monitor_stop_requested(void) {
+    return stop_requested;
+}
+
+void monitor_init(struct monitor *m, void *logger,
+                  const struct monitor_ops *ops, void *ctx) {
+    NOTNULL(m);
+    NOTNULL(ops);
+    memset(m, 0, sizeof(*m));
+    m->logger = logger;
+    m->ops = ops;
+    m->ctx = ctx;
+    m->check_interval = 30;
+    m->max_failure = 5;
+    m->failure_sleep = 60;
+    m->failcmd = "reboot";
+    m->record_fd = -1;
+    m->last_rtt_us = -1;
+    m->passive_tick = PASSIVE_DEFAULT_TICK;
+    m->passive_max_skip = PASSIVE_DEFAULT_MAX_SKIP;
+}
+
+/**
+ * Append a check outcome to the record file, in the trace format read
+ * by the simulator.
+ */
+static void record(struct monitor *m, time_t now, int ok, long rtt_us) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%ld %s %ld\n", (long) now,
+                       ok ? "ok" : "fail", rtt_us);
+    if (len > 0 && write(m->record_fd, buf, (size_t) len) < 0) {
+        log_warning(m->logger, "Cannot write to the record file.");
+    }
+}
+
+static unsigned int step(struct monitor *m) {
+    m->in_failure_sleep = 0;
+    m->wake = 0;
+    // traffic is flowing anyway, save the probe. Never while failures
+    // are being counted, and not too many times in a row
+    if (m->passive && m->failures == 0 && m->skipped < m->passive_max_skip &&
+        passive_sample(m->logger, m->passive, m->ops->now_us(m)) ==
+        PASSIVE_HEALTHY) {
+        ++m->skipped;
+        m->up = 1;
+        log_debug(m->logger, "Passive signals are healthy, skip the check.");
+        if (m->telemetry)
+            telemetry_tick(m->logger, m->telemetry, m->targets->stats,
+                           m->targets->n, m->ops->wall(m));
+        return m->check_interval;
+    }
+    m->skipped = 0;
+    log_info(m->logger, "Check network.");
+    long long t0 = m->ops->now_us(m);
+    m->rtt_us = -1;
+    int rv = m->ops->check(m);
+    long rtt_us = (m->rtt_us >= 0) ? m->rtt_us :
+                  (long) (m->ops->now_us(m) - t0);
+    time_t now = m->ops->wall(m);
+    ++m->checks;
+    m->last_check = now;
+    if (rv == 0) m->last_rtt_us = rtt_us;
+    m->up = (rv == 0);
+    if (m->telemetry)
+        telemetry_tick(m->logger, m->telemetry, m->targets->stats,
+                       m->targets->n, now);
+    if (m->record_fd >= 0) record(m, now, rv == 0, rtt_us);
+    if (rv != 0) {
+        ++m->failures;
+        char buf[64];
+        snprintf(buf, 63, "Network failure detected. counter=%d", m->failures);
+        log_info(m->logger, buf);
+    } else {
+        log_info(m->logger, "Network is OK.");
+        m->failures = 0;
+    }
+    if (m->failures > m->max_failure && m->paused) {
+        log_info(m->logger, "Max failure times exceeded, "
+                            "but actions are paused.");
+        m->failures = 0;
+    } else if (m->failures > m->max_failure) {
+        log_info(m->logger, "Max failure times exceeded.");
+        m->failures = 0; // reset failure counter
+        ++m->actions;
+        m->last_action = now;
+
+        // handle a network failure event
+        char tmp[256];
+        snprintf(tmp, 255, "Run system command `%s`.", m->failcmd);
+        log_info(m->logger, tmp);
+        m->ops->action(m, m->failcmd);
+
+        snprintf(tmp, 255, "Wait %d secs before resume checking.",
+                 m->failure_sleep);
+        log_debug(m->logger, tmp);
+        m->in_failure_sleep = 1;
+        return m->failure_sleep; // then resume checking right now
+    }
+    log_info(m->logger, "Sleeping...");
+    return m->check_interval;
+}
+
+/**
+ * Check the network once, and handle a failure event if there have
+ * been too many continuous failures.
+ * @return Seconds to sleep before the next check.
+ */
+unsigned int monitor_step(struct monitor *m) {
+    unsigned int seconds = step(m);
+    if (m->shm) snapshot_publish(m->shm, m, m->ops->wall(m));
+    return seconds;
+}
+
+static int serve_control(void *arg) {
+    struct monitor *m = arg;
+    if (m->control && control_poll(m->control, m)) m->control = NULL;
+    return m->wake || stop_requested;
+}
+
+/**
+ * Measure latency under load if it is due, serving the control socket
+ * meanwhile. The first measurement is due one interval after the start.
+ * @return Seconds the measurement took.
+ */
+static unsigned int measure_load(struct monitor *m) {
+    time_t now = m->ops->wall(m);
+    // loading a broken network only makes it worse
+    if (!m->up) return 0;
+    if (m->load_due == 0) m->load_due = now + (time_t) m->load_every;
+    if (now < m->load_due) return 0;
+    m->load_due = now + (time_t) m->load_every;
+    long long t0 = m->ops->now_us(m);
+    m->load->serve = serve_control;
+    m->load->serve_arg = m;
+    load_run(m->logger, m->load);
+    return (unsigned int) ((m->ops->now_us(m) - t0) / 1000000);
+}
+
+/**
+ * Sleep between two checks. With a passive sampler, wake up every tick
+ * to take a sample, and cut the sleep short if the signals look bad.
+ * A `check` on the control socket cuts it short as well. A due
+ * measurement of latency under load takes the first part of the sleep.
+ */
+void monitor_sleep(struct monitor *m, unsigned int seconds) {
+    if (m->load) {
+        unsigned int t = measure_load(m);
+        if (t >= seconds || m->wake || stop_requested) return;
+        seconds -= t;
+    }
+    if (!m->passive || m->in_failure_sleep) {
+        m->ops->sleep(m, seconds);
+        return;
+    }
+    while (seconds > 0) {
+        unsigned int t = (seconds < m->passive_tick) ? seconds : m->passive_tick;
+        m->ops->sleep(m, t);
+        seconds -= t;
+        if (m->wake || stop_requested) return;
+        if (seconds > 0 &&
+            passive_sample(m->logger, m->passive, m->ops->now_us(m)) ==
+            PASSIVE_BAD) {
+            log_info(m->logger, "Passive signals are bad, check now.");
+            return;
+        }
+    }
+}
+
+/**
+ * Check network and sleep, until a stop is requested.
+ */
+void monitor_run(struct monitor *m) {
+    while (!stop_requested) {
+        unsigned int seconds = monitor_step(m);
+        if (stop_requested) break;
+        monitor_sleep(m, seconds);
+    }
+}
+
+long long monitor_real_now_us(struct monitor *m) {
+    (void) m;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+time_t monitor_real_wall(struct monitor *m) {
+    (void) m;
+    return time(NULL);
+}
+
+void monitor_real_sleep(struct monitor *m, unsigned int seconds) {
+    unsigned int t = seconds;
+    if (m->control) {
+        long long until = monitor_real_now_us(m) +
+                          (long long) seconds * 1000000LL;
+        if (control_serve(m->control, m, until) == 0) return;
+        // the socket is gone for good, sleep out the rest without it
+        m->control = NULL;
+        long long left = until - monitor_real_now_us(m);
+        t = (left > 0) ? (unsigned int) ((left + 999999) / 1000000) : 0;
+    }
+    while ((t = sleep(t)) && !stop_requested);
+}
+
+void monitor_real_action(struct monitor *m, const char *cmd) {
+    if (system(cmd) == -1) {
+        log_error(m->logger, "system() failed.");
+    }
+}
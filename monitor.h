@@ -0,0 +1,119 @@
+//
+// Created by Keuin on 2022/1/12.
+//
+
+#ifndef NETMON_MONITOR_H
+#define NETMON_MONITOR_H
+
+#include <time.h>
+#include "load.h"
+#include "netmon_shm.h"
+#include "passive.h"
+#include "target.h"
+#include "telemetry.h"
+
+struct monitor;
+struct control;
+
+/**
+ * Everything the monitor needs from the outside world. The daemon uses
+ * the real clock, probes and system(); the simulator substitutes a
+ * virtual clock and scripted outcomes.
+ */
+struct monitor_ops {
+    // run one check. Zero if success, non-zero if failed
+    int (*check)(struct monitor *m);
+    // monotonic time in microseconds
+    long long (*now_us)(struct monitor *m);
+    // wall clock time
+    time_t (*wall)(struct monitor *m);
+    void (*sleep)(struct monitor *m, unsigned int seconds);
+    // handle a network failure event
+    void (*action)(struct monitor *m, const char *cmd);
+};
+
+struct monitor {
+    void *logger;
+    const struct monitor_ops *ops;
+    // private data of ops
+    void *ctx;
+
+    // seconds to sleep between checks
+    unsigned int check_interval;
+    // how many continuous failures trigger the action
+    int max_failure;
+    // seconds to sleep before resuming check after the action
+    unsigned int failure_sleep;
+    // cmd to be executed on failure
+    const char *failcmd;
+
+    int failures;
+    // non-zero if the last check succeeded, or was skipped as healthy
+    int up;
+    // the check may store the RTT it measured here, in microseconds.
+    // Otherwise the duration of the check is used
+    long rtt_us;
+    unsigned long checks;
+    unsigned long actions;
+    // RTT of the last successful check, -1 if none yet
+    long last_rtt_us;
+    // wall clock time of the last check, and of the last action
+    time_t last_check;
+    time_t last_action;
+
+    // optional, NULL if not used
+    struct target_set *targets;
+    struct telemetry *telemetry;
+    // if not negative, append each check outcome to this file
+    int record_fd;
+
+    // shared-memory snapshot to publish to, NULL if not used
+    struct netmon_shm *shm;
+
+    // passive sampler, NULL to always check actively
+    struct passive *passive;
+    // seconds between two passive samples while sleeping
+    unsigned int passive_tick;
+    // active checks skipped in a row at most
+    int passive_max_skip;
+    int skipped;
+    // non-zero while sleeping after the failure action
+    int in_failure_sleep;
+
+    // measure latency under load every load_every seconds while the
+    // network is up, NULL if not used
+    struct load *load;
+    unsigned int load_every;
+    // wall clock time the next measurement is due, 0 until scheduled
+    time_t load_due;
+
+    // control socket served while sleeping, NULL if not used
+    struct control *control;
+    // non-zero to skip the failure action
+    int paused;
+    // set to cut the current sleep short and check now
+    int wake;
+};
+
+void monitor_init(struct monitor *m, void *logger,
+                  const struct monitor_ops *ops, void *ctx);
+
+unsigned int monitor_step(struct monitor *m);
+
+void monitor_sleep(struct monitor *m, unsigned int seconds);
+
+void monitor_run(struct monitor *m);
+
+void monitor_request_stop(void);
+
+int monitor_stop_requested(void);
+
+long long monitor_real_now_us(struct monitor *m);
+
+time_t monitor_real_wall(struct monitor *m);
+
+void monitor_real_sleep(struct monitor *m, unsigned int seconds);
+
+void monitor_real_action(struct monitor *m, const char *cmd);
+
+#endif //NETMON_MONITOR_H
@@ -2,8 +2,13 @@
 // Created by Keuin on 2021/12/29.
 //
 
+#include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <string.h>
@@ -14,6 +19,37 @@
 #include "netcheck.h"
 #include "validate.h"
 
+#define TCP_TEST_HOST "www.gov.cn"
+
+#ifdef NETMON_TINY
+// test host is resolved once at startup, the resolver allocates memory
+static struct in_addr tcp_test_addr;
+static int tcp_test_resolved = 0;
+#endif
+
+/**
+ * Prepare the checks. Must be called after the arena is initialized,
+ * only the first call does the work.
+ * @return Zero if success, non-zero if failed.
+ */
+int netcheck_init(void *logger) {
+#ifdef NETMON_TINY
+    if (tcp_test_resolved) return tcp_test_addr.s_addr == htonl(INADDR_NONE);
+    tcp_test_resolved = 1;
+    const struct hostent *host = gethostbyname(TCP_TEST_HOST);
+    if (!host || host->h_length <= 0 || !host->h_addr_list[0]) {
+        log_warning(logger, "Cannot resolve test host at startup. "
+                            "TCP check will always fail.");
+        tcp_test_addr.s_addr = htonl(INADDR_NONE);
+        return -1;
+    }
+    tcp_test_addr = **((struct in_addr **) host->h_addr_list);
+#else
+    (void) logger;
+#endif
+    return 0;
+}
+
 /**
  * Check network availability by testing a tcp communication.
  * @return Zero if success, non-zero if failed.
@@ -25,7 +61,7 @@ int check_tcp(void *logger) {
     int sock = -1, rv = 0;
     struct sockaddr_in serv_addr;
     const char *msg = "GET / HTTP/1.1\r\n"
-                      "Host: www.gov.cn\r\n"
+                      "Host: " TCP_TEST_HOST "\r\n"
                       "\r\n";
 
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -34,7 +70,16 @@ int check_tcp(void *logger) {
         RETURN(-1);
     }
 
-    const struct hostent *host = gethostbyname("www.gov.cn"); // TODO cache this
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(80);
+#ifdef NETMON_TINY
+    if (tcp_test_addr.s_addr == htonl(INADDR_NONE)) {
+        log_error(logger, "Test host is not resolved.");
+        RETURN(-1);
+    }
+    serv_addr.sin_addr = tcp_test_addr;
+#else
+    const struct hostent *host = gethostbyname(TCP_TEST_HOST); // TODO cache this
 
     if (!host) {
         herror("gethostbyname()");
@@ -47,9 +92,8 @@ int check_tcp(void *logger) {
         RETURN(-1);
     }
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(80);
     serv_addr.sin_addr = **((struct in_addr **) host->h_addr_list);
+#endif
 
     if (connect(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
         log_error(logger, "connect() failed.");
@@ -111,6 +155,11 @@ int check_ping(void *logger, const char *dest, const char *ping) {
         log_error(logger, "dest is not a valid IPv4 address.");
         return -1;
     }
+#ifdef NETMON_TINY
+    // forking a ping process costs more memory than the whole monitor
+    (void) ping;
+    return check_icmp(logger, dest);
+#else
 
 #define BUFLEN 1024
 #define RETURN(r) do { rv = (r); goto CP_RET; } while(0)
@@ -127,21 +176,35 @@ int check_ping(void *logger, const char *dest, const char *ping) {
         return -1;
     }
 
-    if (fork() == 0) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        log_error(logger, "fork() failed.");
+        RETURN(-1);
+    }
+    if (pid == 0) {
         // child
+        close(pipe_arr[0]);
         if (dup2(pipe_arr[1], STDOUT_FILENO) < 0) {
             log_error(logger, "dup2() failed.");
-            exit(-1);
+            _exit(127);
         }
+        close(pipe_arr[1]);
         execl(ping, "ping", "-c 3", dest, (char *) NULL);
+        _exit(127); // must not return into the monitor
     } else {
         // parent
-        if (wait(NULL) < 0) {
-            perror("wait()");
-            log_error(logger, "wait() failed.");
+        // close our writing end, or read() never sees EOF if ping is
+        // missing and nothing is written
+        close(pipe_arr[1]);
+        pipe_arr[1] = -1;
+        // wait for this very child, the logger may have one of its own
+        if (waitpid(pid, NULL, 0) < 0) {
+            perror("waitpid()");
+            log_error(logger, "waitpid() failed.");
             RETURN(-1);
         }
-        if (read(pipe_arr[0], buf, BUFLEN) < 0) {
+        if (read(pipe_arr[0], buf, BUFLEN - 1) < 0) {
             perror("read()");
             log_error(logger, "read() failed.");
             RETURN(-1);
@@ -153,4 +216,87 @@ int check_ping(void *logger, const char *dest, const char *ping) {
     return (rv) ? (rv) : (strstr(buf, "time=") == NULL);
 #undef BUFLEN
 #undef RETURN
+#endif
+}
+
+static uint16_t icmp_checksum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t sum = 0;
+    for (; len > 1; len -= 2, p += 2) sum += (uint32_t) ((p[0] << 8) | p[1]);
+    if (len) sum += (uint32_t) (p[0] << 8);
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return htons((uint16_t) ~sum);
+}
+
+/**
+ * Check network availability by sending ICMP echo requests from this
+ * process. Uses an unprivileged ICMP datagram socket if the kernel allows
+ * it (see `net.ipv4.ping_group_range`), otherwise a raw socket.
+ * @param logger the logger.
+ * @param dest the destination, an IPv4 address in dot-decimal notation.
+ * @return Zero if at least one reply is received, non-zero if failed.
+ */
+int check_icmp(void *logger, const char *dest) {
+#define RETURN(r) do { rv = (r); goto CI_RET; } while(0)
+    int sock, raw = 0, rv = -1;
+    uint16_t ident = (uint16_t) getpid();
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, dest, &addr.sin_addr) != 1) {
+        log_error(logger, "dest is not a valid IPv4 address.");
+        return -1;
+    }
+    if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP)) < 0) {
+        raw = 1;
+        if ((sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
+            perror("socket()");
+            log_error(logger, "Cannot open ICMP socket.");
+            return -1;
+        }
+    }
+    for (uint16_t seq = 1; seq <= ICMP_COUNT; ++seq) {
+        struct icmphdr req;
+        memset(&req, 0, sizeof(req));
+        req.type = ICMP_ECHO;
+        req.un.echo.id = htons(ident);
+        req.un.echo.sequence = htons(seq);
+        req.checksum = icmp_checksum(&req, sizeof(req));
+        if (sendto(sock, &req, sizeof(req), 0, (struct sockaddr *) &addr,
+                   sizeof(addr)) < 0) {
+            perror("sendto()");
+            log_error(logger, "sendto() failed.");
+            RETURN(-1);
+        }
+        struct pollfd pfd = {sock, POLLIN, 0};
+        while (poll(&pfd, 1, ICMP_TIMEOUT_MS) > 0) {
+            unsigned char buf[128];
+            ssize_t rd = recv(sock, buf, sizeof(buf), 0);
+            if (rd < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            const unsigned char *p = buf;
+            if (raw) {
+                // raw sockets deliver the IP header as well
+                size_t ihl = (size_t) (buf[0] & 0x0F) * 4;
+                if ((size_t) rd < ihl) continue;
+                p += ihl;
+                rd -= (ssize_t) ihl;
+            }
+            if ((size_t) rd < sizeof(struct icmphdr)) continue;
+            const struct icmphdr *rep = (const struct icmphdr *) p;
+            // the kernel rewrites the id of datagram sockets, skip that check
+            if (rep->type == ICMP_ECHOREPLY &&
+                rep->un.echo.sequence == htons(seq) &&
+                (!raw || rep->un.echo.id == htons(ident))) {
+                RETURN(0);
+            }
+        }
+    }
+    log_error(logger, "No ICMP echo reply.");
+    CI_RET:
+    close(sock);
+    return rv;
+#undef RETURN
 }
\ No newline at end of file
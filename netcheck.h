@@ -6,8 +6,17 @@
 #define NETMON_NETCHECK_H
 
 
+// echo requests sent by check_icmp() before giving up
+#define ICMP_COUNT 3
+// time to wait for each echo reply, in milliseconds
+#define ICMP_TIMEOUT_MS 1000
+
+int netcheck_init(void *logger);
+
 int check_tcp(void *logger);
 
 int check_ping(void *logger, const char *dest, const char *ping);
 
+int check_icmp(void *logger, const char *dest);
+
 #endif //NETMON_NETCHECK_H
@@ -1,9 +1,28 @@
+#include "arena.h"
+#include "collector.h"
+#include "control.h"
 #include "logging.h"
+#include "monitor.h"
 #include "netcheck.h"
+#include "dns.h"
+#include "load.h"
+#include "sim.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "target.h"
+#include "telemetry.h"
+#include "tls.h"
+#include "udpecho.h"
+#include "validate.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
 #include <sys/stat.h>
 
 #define OPTPARSE_IMPLEMENTATION
@@ -13,9 +32,61 @@
 
 const char *logfile = "netmon.log";
 
-// which host to ping. If NULL, test tcp instead
+// rotation, compression and stderr mirroring of the log
+struct log_options logopts = {
+        .mirror_stderr = 1,
+        .max_size = 0,
+        .max_age = 0,
+        .keep = 5,
+        .compress = 0,
+};
+
+// which host to ping. If not NULL, add a ping target
 const char *pingdest = NULL;
 
+// domain name to resolve. If not NULL, add a DNS target
+const char *dnsname = NULL;
+
+// record type to query when testing DNS
+int dnstype = DNS_TYPE_A;
+
+// resolver to query when testing DNS. Defaults to the one in resolv.conf
+struct sockaddr_in dnsserver;
+int dnsserver_set = 0;
+
+// UDP reflector to exchange packets with. If set, add a UDP echo target
+struct sockaddr_in udpdest;
+int udp_enabled = 0;
+
+// HTTPS server to fetch a page from, as `host[:port][/path]`. If not
+// NULL, add an HTTPS target
+const char *httpsdest = NULL;
+
+// CA certificates to verify HTTPS servers with. System ones if NULL
+const char *tlsca = NULL;
+
+// packets sent by one UDP echo check, and how many per second
+uint32_t udp_count = UDP_ECHO_DEFAULT_COUNT;
+uint32_t udp_rate = UDP_ECHO_DEFAULT_RATE;
+
+// if non-zero, run as a UDP echo reflector on this port instead
+uint16_t reflector_port = 0;
+
+// if non-zero, run as a load sink on this port instead
+uint16_t sink_port = 0;
+
+// sink to measure latency under load against. Disabled if not set
+struct sockaddr_in loaddest;
+int load_enabled = 0;
+
+// parallel TCP streams, and how long they run
+unsigned int load_streams = LOAD_DEFAULT_STREAMS;
+unsigned int load_duration_seconds = LOAD_DEFAULT_DURATION;
+
+// seconds between two measurements while monitoring. If 0, measure once
+// and exit instead of monitoring
+unsigned int load_every_seconds = 0;
+
 // TODO support blanks
 // cmd to be executed. If NULL, reboot
 const char *failcmd = "reboot";
@@ -29,14 +100,72 @@ int max_check_failure = 5;
 // should run as a daemon process
 int as_daemon = 0;
 
-// TODO make failure_sleep_seconds configurable
 // seconds to sleep before resuming check after a network failure is detected
 unsigned int failure_sleep_seconds = 60;
 
-volatile int failure_detected = 0;
+// where to push telemetry summaries. Disabled if not set
+struct sockaddr_in pushdest;
+int push_enabled = 0;
+
+// seconds between two telemetry summaries
+unsigned int push_interval_seconds = 60;
+
+// name of this site in telemetry summaries. Defaults to the hostname
+const char *sitename = NULL;
+
+// if non-zero, run as a telemetry collector on this port instead
+uint16_t collector_port = 0;
+
+// max number of sites the collector tracks
+size_t collector_sites = COLLECTOR_DEFAULT_SITES;
+
+// targets to check, and their statistics, allocated from the arena.
+// The network is down only if all of them fail. Tcp if none is given
+struct target_set *targets = NULL;
+
+// telemetry pusher state, allocated from the arena
+struct telemetry *telemetry = NULL;
+
+// if not NULL, replay this trace with a virtual clock instead of monitoring
+const char *simtrace = NULL;
+
+// bytes reserved for the trace, it is loaded into exactly this much
+size_t simsize = 0;
+
+// simulated duration of a failed check, in seconds
+double sim_timeout_seconds = 5;
+
+// down periods shorter than this are not outages in simulation, in seconds
+long sim_min_outage_seconds = 60;
+
+// if not NULL, append the outcome of every check to this file
+const char *recordfile = NULL;
+
+// use kernel counters to skip or hurry active checks
+int passive_enabled = 0;
+unsigned int passive_tick_seconds = PASSIVE_DEFAULT_TICK;
+int passive_max_skip = PASSIVE_DEFAULT_MAX_SKIP;
+// count rx on this interface instead of the one of the default route
+const char *passive_iface = NULL;
+
+// if not NULL, publish the state in this shared-memory file
+const char *shmfile = NULL;
+
+// if not NULL, print the snapshot in this file and exit
+const char *statusfile = NULL;
+
+// if not NULL, accept commands on a Unix-domain socket at this path
+const char *controlpath = NULL;
 
 void *logger = NULL;
 
+#ifdef NETMON_TINY
+// argv outlives the monitor, no need to copy option strings
+#define OPTSTR(s) (s)
+#else
+#define OPTSTR(s) strdup(s)
+#endif
+
 void daemonize() {
     pid_t pid = 0;
     pid_t sid = 0;
@@ -66,9 +195,19 @@ void daemonize() {
         log_error(logger, "chdir() failed,");
         exit(1);
     }
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    // keep fd 0-2 occupied, or sockets opened later may take them
+    // and receive what is written to stderr
+    int fd = open("/dev/null", O_RDWR);
+    if (fd < 0) {
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+        return;
+    }
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) close(fd);
 }
 
 ///**
@@ -112,49 +251,144 @@ void daemonize() {
 //    }
 //}
 
-void loop() {
-    // check network and sleep
-    // if fails too many times continuously, set require_reboot flag and return
-    int failures = 0;
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "EndlessLoop"
-    while (1) {
-        log_info(logger, "Check network.");
-        if ((pingdest == NULL) ?
-            (check_tcp(logger) != 0) :
-            (check_ping(logger, pingdest, NULL) != 0)) {
-            ++failures;
-            char buf[64];
-            snprintf(buf, 63, "Network failure detected. counter=%d", failures);
-            log_info(logger, buf);
-        } else {
-            log_info(logger, "Network is OK.");
-            failures = 0;
-        }
-        if (failures > max_check_failure) {
-            log_info(logger, "Max failure times exceeded.");
-            failure_detected = 1;
-            failures = 0; // reset failure counter
-
-            // handle a network failure event
-            char tmp[256];
-            snprintf(tmp, 255, "Run system command `%s`.", failcmd);
-            log_info(logger, tmp);
-            system(failcmd);
-
-            snprintf(tmp, 255, "Wait %d secs before resume checking.\n",
-                     failure_sleep_seconds);
-            log_debug(logger, tmp);
-            unsigned t = failure_sleep_seconds;
-            while ((t = sleep(t)));
-
-            continue; // resume checking right now
-        }
-        log_info(logger, "Sleeping...");
-        unsigned int t = check_interval_seconds;
-        while ((t = sleep(t)));
-    }
-#pragma clang diagnostic pop
+/**
+ * Check the configured targets against the real network.
+ */
+int run_check(struct monitor *m) {
+    return targets_check(m->logger, m->targets, &m->rtt_us);
+}
+
+const struct monitor_ops real_ops = {
+        .check = run_check,
+        .now_us = monitor_real_now_us,
+        .wall = monitor_real_wall,
+        .sleep = monitor_real_sleep,
+        .action = monitor_real_action,
+};
+
+// long options without a short form
+enum {
+    OPT_DNS_TYPE = 256,
+    OPT_PUSH,
+    OPT_PUSH_INTERVAL,
+    OPT_SITE,
+    OPT_COLLECTOR,
+    OPT_MAX_SITES,
+    OPT_LOG_MAX_SIZE,
+    OPT_LOG_MAX_AGE,
+    OPT_LOG_KEEP,
+    OPT_LOG_COMPRESS,
+    OPT_NO_STDERR,
+    OPT_FAILURE_SLEEP,
+    OPT_SIMULATE,
+    OPT_SIM_TIMEOUT,
+    OPT_SIM_MIN_OUTAGE,
+    OPT_RECORD,
+    OPT_PASSIVE,
+    OPT_PASSIVE_TICK,
+    OPT_PASSIVE_MAX_SKIP,
+    OPT_PASSIVE_IFACE,
+    OPT_UDP_COUNT,
+    OPT_UDP_RATE,
+    OPT_REFLECTOR,
+    OPT_SHM,
+    OPT_STATUS,
+    OPT_CONTROL,
+    OPT_HTTPS,
+    OPT_TLS_CA,
+    OPT_SINK,
+    OPT_LOAD,
+    OPT_LOAD_STREAMS,
+    OPT_LOAD_DURATION,
+    OPT_LOAD_EVERY,
+};
+
+/**
+ * Print the snapshot published by another netmon.
+ * @return Exit code: 0 if the network is up, i.e. any target is, 1 if
+ * every checked target is down, 2 if the snapshot is not available, its
+ * writer is gone or stopped updating it, or no target was checked yet.
+ */
+static int print_status(const char *path) {
+    const struct netmon_shm *shm = netmon_shm_open(path);
+    struct netmon_shm snap;
+    if (!shm || netmon_shm_snapshot(shm, &snap, 1000)) {
+        fprintf(stderr, "Cannot read snapshot: %s\n", path);
+        if (shm) netmon_shm_close(shm);
+        return 2;
+    }
+    netmon_shm_close(shm);
+    printf("pid %u updated %lld interval %u actions %llu last_action %lld "
+           "`%s`\n", snap.pid, (long long) snap.updated, snap.interval,
+           (unsigned long long) snap.actions, (long long) snap.last_action,
+           snap.last_action_cmd);
+    for (uint32_t i = 0; i < snap.n_targets && i < NETMON_SHM_MAX_TARGETS; ++i) {
+        const struct netmon_shm_target *t = &snap.targets[i];
+        printf("target %s %s failures %d rtt %lld us last_check %lld "
+               "last_change %lld probes %llu failed %llu\n",
+               t->name, !t->last_check ? "unknown" : t->up ? "up" : "down",
+               t->consecutive_failures,
+               (long long) t->last_rtt_us, (long long) t->last_check,
+               (long long) t->last_change, (unsigned long long) t->probes,
+               (unsigned long long) t->failures);
+    }
+    if (kill((pid_t) snap.pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "netmon %u is not running.\n", snap.pid);
+        return 2;
+    }
+    if (netmon_shm_stale(&snap, (int64_t) time(NULL))) {
+        fprintf(stderr, "Snapshot is stale, last updated %lld.\n",
+                (long long) snap.updated);
+        return 2;
+    }
+    int up = netmon_shm_any_up(&snap);
+    if (up < 0) {
+        fprintf(stderr, "No target was checked yet.\n");
+        return 2;
+    }
+    return up ? 0 : 1;
+}
+
+/**
+ * Parse a size in bytes with an optional k, M or G suffix.
+ * @return The size, or -1 if invalid.
+ */
+static long parse_size(const char *s) {
+    char *end;
+    int shift;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || v < 0 || errno == ERANGE) return -1;
+    switch (*end) {
+        case '\0':
+            return v;
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        default:
+            return -1;
+    }
+    if (end[1] != '\0' || v > (LONG_MAX >> shift)) return -1;
+    return v << shift;
+}
+
+static void on_sighup(int sig) {
+    (void) sig;
+    log_request_reopen();
+}
+
+static void on_sigterm(int sig) {
+    (void) sig;
+    monitor_request_stop();
 }
 
 int main(int argc, char *argv[]) {
@@ -164,6 +398,42 @@ int main(int argc, char *argv[]) {
             {"log",         'l', OPTPARSE_REQUIRED},
             {"ping",        'p', OPTPARSE_REQUIRED},
             {"command",     'c', OPTPARSE_REQUIRED},
+            {"dns",         'q', OPTPARSE_REQUIRED},
+            {"resolver",    'r', OPTPARSE_REQUIRED},
+            {"dns-type",    OPT_DNS_TYPE, OPTPARSE_REQUIRED},
+            {"push",        OPT_PUSH, OPTPARSE_REQUIRED},
+            {"push-interval", OPT_PUSH_INTERVAL, OPTPARSE_REQUIRED},
+            {"site",        OPT_SITE, OPTPARSE_REQUIRED},
+            {"collector",   OPT_COLLECTOR, OPTPARSE_REQUIRED},
+            {"max-sites",   OPT_MAX_SITES, OPTPARSE_REQUIRED},
+            {"log-max-size", OPT_LOG_MAX_SIZE, OPTPARSE_REQUIRED},
+            {"log-max-age", OPT_LOG_MAX_AGE, OPTPARSE_REQUIRED},
+            {"log-keep",    OPT_LOG_KEEP, OPTPARSE_REQUIRED},
+            {"log-compress", OPT_LOG_COMPRESS, OPTPARSE_NONE},
+            {"no-stderr",   OPT_NO_STDERR, OPTPARSE_NONE},
+            {"failure-sleep", OPT_FAILURE_SLEEP, OPTPARSE_REQUIRED},
+            {"simulate",    OPT_SIMULATE, OPTPARSE_REQUIRED},
+            {"sim-timeout", OPT_SIM_TIMEOUT, OPTPARSE_REQUIRED},
+            {"sim-min-outage", OPT_SIM_MIN_OUTAGE, OPTPARSE_REQUIRED},
+            {"record",      OPT_RECORD, OPTPARSE_REQUIRED},
+            {"passive",     OPT_PASSIVE, OPTPARSE_NONE},
+            {"passive-tick", OPT_PASSIVE_TICK, OPTPARSE_REQUIRED},
+            {"passive-max-skip", OPT_PASSIVE_MAX_SKIP, OPTPARSE_REQUIRED},
+            {"passive-iface", OPT_PASSIVE_IFACE, OPTPARSE_REQUIRED},
+            {"udp-echo",    'u', OPTPARSE_REQUIRED},
+            {"udp-count",   OPT_UDP_COUNT, OPTPARSE_REQUIRED},
+            {"udp-rate",    OPT_UDP_RATE, OPTPARSE_REQUIRED},
+            {"reflector",   OPT_REFLECTOR, OPTPARSE_REQUIRED},
+            {"shm",         OPT_SHM, OPTPARSE_REQUIRED},
+            {"status",      OPT_STATUS, OPTPARSE_REQUIRED},
+            {"control",     OPT_CONTROL, OPTPARSE_REQUIRED},
+            {"https",       OPT_HTTPS, OPTPARSE_REQUIRED},
+            {"tls-ca",      OPT_TLS_CA, OPTPARSE_REQUIRED},
+            {"sink",        OPT_SINK, OPTPARSE_REQUIRED},
+            {"load",        OPT_LOAD, OPTPARSE_REQUIRED},
+            {"load-streams", OPT_LOAD_STREAMS, OPTPARSE_REQUIRED},
+            {"load-duration", OPT_LOAD_DURATION, OPTPARSE_REQUIRED},
+            {"load-every",  OPT_LOAD_EVERY, OPTPARSE_REQUIRED},
             {"daemon",      'd', OPTPARSE_NONE},
             {"help",        'h', OPTPARSE_NONE},
             {0}
@@ -196,13 +466,211 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             case 'l':
-                logfile = strdup(options.optarg);
+                logfile = OPTSTR(options.optarg);
                 break;
             case 'p':
-                pingdest = strdup(options.optarg);
+                pingdest = OPTSTR(options.optarg);
                 break;
             case 'c':
-                failcmd = strdup(options.optarg);
+                failcmd = OPTSTR(options.optarg);
+                break;
+            case 'q':
+                dnsname = OPTSTR(options.optarg);
+                break;
+            case 'r':
+                if (dns_parse_server(options.optarg, &dnsserver)) {
+                    die("Invalid resolver address: %s\n", options.optarg);
+                }
+                dnsserver_set = 1;
+                break;
+            case OPT_DNS_TYPE:
+                dnstype = dns_parse_type(options.optarg);
+                if (dnstype < 0) {
+                    die("Invalid DNS record type: %s\n", options.optarg);
+                }
+                break;
+            case OPT_PUSH:
+                if (parse_ipv4_endpoint(options.optarg, 0, &pushdest) ||
+                    pushdest.sin_port == 0) {
+                    die("Invalid collector address: %s\n", options.optarg);
+                }
+                push_enabled = 1;
+                break;
+            case OPT_PUSH_INTERVAL:
+                push_interval_seconds = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || (int) push_interval_seconds <= 0) {
+                    die("Invalid push interval: %s\n", options.optarg);
+                }
+                break;
+            case OPT_SITE:
+                sitename = OPTSTR(options.optarg);
+                break;
+            case OPT_COLLECTOR: {
+                long port = strtol(options.optarg, &end, 10);
+                if (*end != '\0' || port <= 0 || port > 65535) {
+                    die("Invalid collector port: %s\n", options.optarg);
+                }
+                collector_port = (uint16_t) port;
+                break;
+            }
+            case OPT_MAX_SITES:
+                collector_sites = (size_t) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || (long) collector_sites <= 0) {
+                    die("Invalid max sites: %s\n", options.optarg);
+                }
+                break;
+            case OPT_LOG_MAX_SIZE:
+                if ((logopts.max_size = parse_size(options.optarg)) < 0) {
+                    die("Invalid log size: %s\n", options.optarg);
+                }
+                break;
+            case OPT_LOG_MAX_AGE:
+                logopts.max_age = strtol(options.optarg, &end, 10);
+                if (*end != '\0' || logopts.max_age < 0) {
+                    die("Invalid log age: %s\n", options.optarg);
+                }
+                break;
+            case OPT_LOG_KEEP:
+                logopts.keep = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || logopts.keep < 0) {
+                    die("Invalid number of logs to keep: %s\n",
+                        options.optarg);
+                }
+                break;
+            case OPT_LOG_COMPRESS:
+                logopts.compress = 1;
+                break;
+            case OPT_NO_STDERR:
+                logopts.mirror_stderr = 0;
+                break;
+            case OPT_FAILURE_SLEEP:
+                failure_sleep_seconds = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || (int) failure_sleep_seconds < 0) {
+                    die("Invalid failure sleep: %s\n", options.optarg);
+                }
+                break;
+            case OPT_SIMULATE:
+                simtrace = OPTSTR(options.optarg);
+                break;
+            case OPT_SIM_TIMEOUT:
+                sim_timeout_seconds = strtod(options.optarg, &end);
+                if (*end != '\0' || sim_timeout_seconds < 0) {
+                    die("Invalid simulated timeout: %s\n", options.optarg);
+                }
+                break;
+            case OPT_SIM_MIN_OUTAGE:
+                sim_min_outage_seconds = strtol(options.optarg, &end, 10);
+                if (*end != '\0' || sim_min_outage_seconds < 0) {
+                    die("Invalid min outage: %s\n", options.optarg);
+                }
+                break;
+            case OPT_RECORD:
+                recordfile = OPTSTR(options.optarg);
+                break;
+            case OPT_PASSIVE:
+                passive_enabled = 1;
+                break;
+            case OPT_PASSIVE_TICK:
+                passive_tick_seconds = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || (int) passive_tick_seconds <= 0) {
+                    die("Invalid passive tick: %s\n", options.optarg);
+                }
+                break;
+            case OPT_PASSIVE_MAX_SKIP:
+                passive_max_skip = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || passive_max_skip < 0) {
+                    die("Invalid passive max skip: %s\n", options.optarg);
+                }
+                break;
+            case OPT_PASSIVE_IFACE:
+                if (strlen(options.optarg) >= IFNAMSIZ) {
+                    die("Invalid passive interface: %s\n", options.optarg);
+                }
+                passive_iface = OPTSTR(options.optarg);
+                break;
+            case 'u':
+                if (parse_ipv4_endpoint(options.optarg, UDP_ECHO_DEFAULT_PORT,
+                                        &udpdest)) {
+                    die("Invalid reflector address: %s\n", options.optarg);
+                }
+                udp_enabled = 1;
+                break;
+            case OPT_UDP_COUNT:
+                udp_count = (uint32_t) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || udp_count == 0 ||
+                    udp_count > UDP_ECHO_MAX_COUNT) {
+                    die("UDP echo count should be 1 to %d.\n",
+                        UDP_ECHO_MAX_COUNT);
+                }
+                break;
+            case OPT_UDP_RATE:
+                udp_rate = (uint32_t) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || udp_rate == 0 || udp_rate > 1000000) {
+                    die("Invalid UDP echo rate: %s\n", options.optarg);
+                }
+                break;
+            case OPT_REFLECTOR: {
+                long port = strtol(options.optarg, &end, 10);
+                if (*end != '\0' || port <= 0 || port > 65535) {
+                    die("Invalid reflector port: %s\n", options.optarg);
+                }
+                reflector_port = (uint16_t) port;
+                break;
+            }
+            case OPT_SHM:
+                shmfile = OPTSTR(options.optarg);
+                break;
+            case OPT_STATUS:
+                statusfile = options.optarg;
+                break;
+            case OPT_CONTROL:
+                controlpath = OPTSTR(options.optarg);
+                break;
+            case OPT_HTTPS:
+#ifndef NETMON_TLS
+                die("HTTPS checks are not built in.\n");
+#endif
+                httpsdest = OPTSTR(options.optarg);
+                break;
+            case OPT_TLS_CA:
+                tlsca = OPTSTR(options.optarg);
+                break;
+            case OPT_SINK: {
+                long port = strtol(options.optarg, &end, 10);
+                if (*end != '\0' || port <= 0 || port > 65535) {
+                    die("Invalid sink port: %s\n", options.optarg);
+                }
+                sink_port = (uint16_t) port;
+                break;
+            }
+            case OPT_LOAD:
+                if (parse_ipv4_endpoint(options.optarg, LOAD_DEFAULT_PORT,
+                                        &loaddest)) {
+                    die("Invalid sink address: %s\n", options.optarg);
+                }
+                load_enabled = 1;
+                break;
+            case OPT_LOAD_STREAMS:
+                load_streams = (unsigned int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || load_streams == 0 ||
+                    load_streams > LOAD_MAX_STREAMS) {
+                    die("Load streams should be 1 to %d.\n", LOAD_MAX_STREAMS);
+                }
+                break;
+            case OPT_LOAD_DURATION:
+                load_duration_seconds = (unsigned int) strtol(options.optarg,
+                                                              &end, 10);
+                if (*end != '\0' || load_duration_seconds == 0 ||
+                    load_duration_seconds > LOAD_MAX_DURATION) {
+                    die("Load duration should be 1 to %d seconds.\n",
+                        LOAD_MAX_DURATION);
+                }
+                break;
+            case OPT_LOAD_EVERY:
+                load_every_seconds = (int) strtol(options.optarg, &end, 10);
+                if (*end != '\0' || (int) load_every_seconds <= 0) {
+                    die("Invalid load interval: %s\n", options.optarg);
+                }
                 break;
             case 'd':
                 as_daemon = 1;
@@ -214,7 +682,31 @@ int main(int argc, char *argv[]) {
                        "[-l <log_file>] "
                        "[-c <cmd>] "
                        "[-p <ping_host>] "
-                       "[-d]\n",
+                       "[-q <dns_name> [-r <resolver>] [--dns-type <type>]] "
+                       "[-u <reflector> [--udp-count <n>] [--udp-rate <pps>]] "
+                       "[--https <host[:port][/path]> [--tls-ca <file>]] "
+                       "[--push <ip:port> [--push-interval <secs>] "
+                       "[--site <name>]] "
+                       "[--log-max-size <bytes>] [--log-max-age <secs>] "
+                       "[--log-keep <n>] [--log-compress] [--no-stderr] "
+                       "[--failure-sleep <secs>] [--record <trace_file>] "
+                       "[--passive [--passive-tick <secs>] "
+                       "[--passive-max-skip <n>] [--passive-iface <name>]] "
+                       "[--shm <file>] [--control <socket>] "
+                       "[--load <sink> --load-every <secs> "
+                       "[--load-streams <n>] [--load-duration <secs>]] "
+                       "[-d]\n"
+                       "       %s --status <file>\n"
+                       "       %s --simulate <trace_file> [-t <check_interval>] "
+                       "[-n <max_failure>] [--failure-sleep <secs>] "
+                       "[--sim-timeout <secs>] [--sim-min-outage <secs>]\n"
+                       "       %s --collector <port> [--max-sites <n>] "
+                       "[-l <log_file>] [-d]\n"
+                       "       %s --reflector <port> [-l <log_file>] [-d]\n"
+                       "       %s --load <sink> [--load-streams <n>] "
+                       "[--load-duration <secs>]\n"
+                       "       %s --sink <port> [-l <log_file>] [-d]\n",
+                       argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
                        argv[0]);
                 exit(0);
             default:
@@ -222,14 +714,231 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    logger = log_init(logfile);
+    if (statusfile != NULL) {
+        return print_status(statusfile);
+    }
+
+    if (dnsname != NULL && !dnsserver_set && dns_default_server(&dnsserver)) {
+        die("No resolver is specified and none is found in "
+            "/etc/resolv.conf.\n");
+    }
+
+    char hostname[SITE_NAME_MAX] = {0};
+    if (sitename == NULL) {
+        gethostname(hostname, SITE_NAME_MAX - 1);
+        sitename = hostname;
+    }
+
+    // size the arena from the configuration, nothing is allocated later
+    arena_reserve(log_footprint());
+    arena_reserve(sizeof(struct monitor));
+    if (simtrace != NULL) {
+        if ((simsize = sim_footprint(simtrace)) == 0) {
+            die("Cannot read trace: %s\n", simtrace);
+        }
+        arena_reserve(sizeof(struct sim) + simsize);
+    } else if (collector_port) {
+        arena_reserve(collector_footprint(collector_sites));
+    } else if (reflector_port) {
+        arena_reserve(reflector_footprint());
+    } else if (sink_port) {
+        arena_reserve(sink_footprint());
+    } else {
+        arena_reserve(sizeof(struct target_set));
+        if (load_enabled) arena_reserve(load_footprint());
+        if (controlpath != NULL) arena_reserve(control_footprint());
+        if (push_enabled) arena_reserve(sizeof(struct telemetry));
+        if (passive_enabled) arena_reserve(sizeof(struct passive));
+    }
+    if (arena_init()) {
+        die("Cannot allocate %zu bytes of memory.\n", arena_size());
+    }
+
+    if (simtrace != NULL) {
+        // the monitor logs heavily, keep it out of the way of the report
+        logger = log_init(NULL);
+        logopts.mirror_stderr = 0;
+    } else {
+        logger = log_init(logfile);
+    }
+    if (logger == NULL) {
+        die("Cannot open log file: %s\n", logfile);
+    }
+    log_set_options(logger, &logopts);
+    // reopen the log after it is moved away by an external logrotate
+    signal(SIGHUP, on_sighup);
     log_debug(logger, "DEBUG logging is enabled.");
+    if (collector_port) {
+        if (as_daemon) {
+            log_info(logger, "Daemonizing...");
+            daemonize();
+        }
+        collector_run(logger, collector_port, collector_sites);
+        log_free(logger);
+        return 1;
+    }
+    if (reflector_port) {
+        if (as_daemon) {
+            log_info(logger, "Daemonizing...");
+            daemonize();
+        }
+        reflector_run(logger, reflector_port);
+        log_free(logger);
+        return 1;
+    }
+    if (sink_port) {
+        if (as_daemon) {
+            log_info(logger, "Daemonizing...");
+            daemonize();
+        }
+        sink_run(logger, sink_port);
+        log_free(logger);
+        return 1;
+    }
+
+    struct monitor *monitor = arena_alloc(sizeof(struct monitor));
+    if (monitor == NULL) {
+        die("Cannot allocate the monitor.\n");
+    }
+    monitor_init(monitor, logger, &real_ops, NULL);
+    monitor->check_interval = check_interval_seconds;
+    monitor->max_failure = max_check_failure;
+    monitor->failure_sleep = failure_sleep_seconds;
+    monitor->failcmd = failcmd;
+    if (simtrace != NULL) {
+        struct sim *sim = arena_alloc(sizeof(struct sim));
+        if (sim == NULL) {
+            die("Cannot allocate the simulator.\n");
+        }
+        sim->timeout_us = (long) (sim_timeout_seconds * 1e6);
+        sim->min_outage_us = (long long) sim_min_outage_seconds * 1000000LL;
+        if (sim_load(logger, sim, simtrace, simsize)) {
+            die("Cannot load trace: %s\n", simtrace);
+        }
+        sim_run(sim, monitor);
+        log_free(logger);
+        return 0;
+    }
+    if (load_enabled) {
+        struct load *load = arena_alloc(sizeof(struct load));
+        if (load == NULL || load_init(logger, load, &loaddest, load_streams,
+                      load_duration_seconds)) {
+            die("Cannot set up the load generator.\n");
+        }
+        if (load_every_seconds == 0) {
+            char buf[256];
+            int rv = load_run(logger, load);
+            load_format(&load->last, buf, sizeof(buf));
+            printf("%s\n", buf);
+            log_free(logger);
+            return rv ? 1 : 0;
+        }
+        monitor->load = load;
+        monitor->load_every = load_every_seconds;
+    }
+
+    if ((targets = arena_alloc(sizeof(struct target_set))) == NULL) {
+        die("Cannot allocate the targets.\n");
+    }
+    targets_init(targets);
+    {
+        struct target t;
+        if (dnsname != NULL) {
+            memset(&t, 0, sizeof(t));
+            t.type = TARGET_DNS;
+            strncpy(t.host, dnsname, DNS_MAX_NAME);
+            t.addr = dnsserver;
+            t.qtype = (uint16_t) dnstype;
+            targets_add(logger, targets, &t);
+        }
+        if (udp_enabled) {
+            memset(&t, 0, sizeof(t));
+            t.type = TARGET_UDP_ECHO;
+            t.addr = udpdest;
+            t.count = udp_count;
+            t.rate = udp_rate;
+            targets_add(logger, targets, &t);
+        }
+#ifdef NETMON_TLS
+        tls_set_ca(tlsca);
+        if (httpsdest != NULL) {
+            char words[DNS_MAX_NAME + TLS_PATH_MAX + 16];
+            const char *slash = strchr(httpsdest, '/');
+            int hostlen = slash ? (int) (slash - httpsdest) :
+                          (int) strlen(httpsdest);
+            snprintf(words, sizeof(words), "https %.*s %s", hostlen,
+                     httpsdest, slash ? slash : "/");
+            if (target_parse(&t, words) || targets_add(logger, targets, &t)) {
+                die("Invalid HTTPS server: %s\n", httpsdest);
+            }
+        }
+#endif
+        if (pingdest != NULL) {
+            memset(&t, 0, sizeof(t));
+            t.type = TARGET_PING;
+            strncpy(t.host, pingdest, DNS_MAX_NAME);
+            targets_add(logger, targets, &t);
+        }
+        if (targets->n == 0) {
+            memset(&t, 0, sizeof(t));
+            t.type = TARGET_TCP;
+            targets_add(logger, targets, &t);
+        }
+        monitor->targets = targets;
+    }
+    if (push_enabled) {
+        telemetry = arena_alloc(sizeof(struct telemetry));
+        if (telemetry == NULL || telemetry_init(logger, telemetry, &pushdest, sitename,
+                           push_interval_seconds)) {
+            die("Cannot set up telemetry push.\n");
+        }
+        monitor->telemetry = telemetry;
+    }
+    if (shmfile != NULL) {
+        if ((monitor->shm = snapshot_open(logger, shmfile)) == NULL) {
+            die("Cannot publish snapshot to: %s\n", shmfile);
+        }
+    }
+    if (controlpath != NULL) {
+        // targets may be added from the socket while the monitor runs
+        targets_prepare(logger);
+        if ((monitor->control = control_open(logger, controlpath)) == NULL) {
+            die("Cannot listen on control socket: %s\n", controlpath);
+        }
+    }
+    if (passive_enabled) {
+        if ((monitor->passive = arena_alloc(sizeof(struct passive))) == NULL) {
+            die("Cannot allocate the passive sampler.\n");
+        }
+        if (passive_iface != NULL) {
+            strcpy(monitor->passive->iface, passive_iface);
+        }
+        monitor->passive_tick = passive_tick_seconds;
+        monitor->passive_max_skip = passive_max_skip;
+    }
+    if (recordfile != NULL) {
+        monitor->record_fd = open(recordfile,
+                                  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                                  0644);
+        if (monitor->record_fd < 0) {
+            die("Cannot open record file: %s\n", recordfile);
+        }
+    }
+    {
+        char buf[96];
+        snprintf(buf, 95, "Memory budget: arena %zu bytes, RSS %ld KiB.",
+                 arena_size(), rss_bytes() / 1024);
+        log_info(logger, buf);
+    }
     if (as_daemon) {
         log_info(logger, "Daemonizing...");
         daemonize();
     }
+    // stop after the current check, so that log_free() flushes the log
+    signal(SIGTERM, on_sigterm);
+    signal(SIGINT, on_sigterm);
     log_info(logger, "netmon is started.");
-    loop();
+    monitor_run(monitor);
     log_info(logger, "netmon is stopped.");
     log_free(logger);
     return 0;
@@ -0,0 +1,145 @@
+//
+// Created by Keuin on 2022/1/16.
+//
+// Shared-memory health snapshot published by netmon with `--shm <file>`.
+// This header is all a consumer needs: map the file once with
+// netmon_shm_open(), then poll netmon_shm_snapshot() as often as you
+// like. Polling makes no syscalls and never blocks the monitor, which
+// protects the region with a sequence lock.
+//
+
+#ifndef NETMON_SHM_H
+#define NETMON_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NETMON_SHM_MAGIC 0x4E4D5348u // "NMSH"
+#define NETMON_SHM_VERSION 1
+#define NETMON_SHM_MAX_TARGETS 8
+#define NETMON_SHM_NAME_MAX 48
+#define NETMON_SHM_CMD_MAX 64
+// a snapshot is stale if not updated for this many intervals, plus the
+// slack a slow check or a load measurement may take
+#define NETMON_SHM_STALE_INTERVALS 3
+#define NETMON_SHM_STALE_SLACK 90
+
+struct netmon_shm_target {
+    char name[NETMON_SHM_NAME_MAX];
+    // non-zero if the last check succeeded, zero before the first check
+    uint32_t up;
+    int32_t consecutive_failures;
+    // RTT of the last successful check in microseconds, -1 if none yet
+    int64_t last_rtt_us;
+    // unix time of the last check, 0 if the target was not checked yet,
+    // and of the last change of `up`
+    int64_t last_check;
+    int64_t last_change;
+    uint64_t probes;
+    uint64_t failures;
+};
+
+struct netmon_shm {
+    uint32_t magic;
+    uint32_t version;
+    // odd while the monitor is writing
+    uint32_t seq;
+    uint32_t pid;
+    // unix time of the last update
+    int64_t updated;
+    // unix time the failure action last ran, 0 if never
+    int64_t last_action;
+    uint64_t actions;
+    char last_action_cmd[NETMON_SHM_CMD_MAX];
+    uint32_t n_targets;
+    // seconds until the next update is due, 0 from writers before it was
+    // added
+    uint32_t interval;
+    struct netmon_shm_target targets[NETMON_SHM_MAX_TARGETS];
+};
+
+/**
+ * Map the snapshot read-only.
+ * @return The region, or NULL if it cannot be mapped or is not a netmon
+ * snapshot of this version.
+ */
+static inline const struct netmon_shm *netmon_shm_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    void *p = mmap(NULL, sizeof(struct netmon_shm), PROT_READ, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    const struct netmon_shm *shm = (const struct netmon_shm *) p;
+    if (shm->magic != NETMON_SHM_MAGIC || shm->version != NETMON_SHM_VERSION) {
+        munmap(p, sizeof(struct netmon_shm));
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void netmon_shm_close(const struct netmon_shm *shm) {
+    munmap((void *) shm, sizeof(struct netmon_shm));
+}
+
+/**
+ * Take a consistent copy of the snapshot.
+ * @param shm the mapped region.
+ * @param out where to store the copy.
+ * @param max_tries give up after this many torn reads, 0 for no limit.
+ * @return Zero if success, non-zero if the writer kept interfering.
+ */
+static inline int netmon_shm_snapshot(const struct netmon_shm *shm,
+                                      struct netmon_shm *out,
+                                      unsigned max_tries) {
+    for (unsigned i = 0; max_tries == 0 || i < max_tries; ++i) {
+        uint32_t s1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1) continue; // being written
+        memcpy(out, shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t s2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+        if (s1 == s2) return 0;
+    }
+    return -1;
+}
+
+/**
+ * @param now the current unix time.
+ * @return Non-zero if the writer stopped updating the snapshot.
+ */
+static inline int netmon_shm_stale(const struct netmon_shm *snap,
+                                   int64_t now) {
+    return now - snap->updated > (int64_t) snap->interval *
+                                 NETMON_SHM_STALE_INTERVALS +
+                                 NETMON_SHM_STALE_SLACK;
+}
+
+/**
+ * @return Non-zero if every target was up at the last check.
+ */
+static inline int netmon_shm_all_up(const struct netmon_shm *snap) {
+    for (uint32_t i = 0; i < snap->n_targets; ++i) {
+        if (!snap->targets[i].up) return 0;
+    }
+    return 1;
+}
+
+/**
+ * The verdict of the monitor: the network is up if any target is, and
+ * only down if every target checked so far failed.
+ * @return 1 if up, 0 if down, -1 if no target was checked yet.
+ */
+static inline int netmon_shm_any_up(const struct netmon_shm *snap) {
+    int checked = 0;
+    for (uint32_t i = 0; i < snap->n_targets; ++i) {
+        if (snap->targets[i].last_check == 0) continue;
+        if (snap->targets[i].up) return 1;
+        checked = 1;
+    }
+    return checked ? 0 : -1;
+}
+
+#endif //NETMON_SHM_H
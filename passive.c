@@ -0,0 +1,218 @@
+//
+// Created by Keuin on 2022/1/14.
+//
+// Passive health signals: deltas of kernel network counters tell whether
+// traffic is flowing without sending anything. They are read from
+// /proc/net with plain read(2), so sampling costs a few syscalls and
+// never allocates.
+//
+// Received traffic is only counted on the uplink, the interface of the
+// default route unless configured, so a busy LAN does not pass for a
+// healthy WAN.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "logging.h"
+#include "passive.h"
+
+/**
+ * Read a whole file into the sampler's buffer.
+ * @return Zero if success, non-zero if failed.
+ */
+static int slurp(struct passive *p, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    size_t len = 0;
+    ssize_t rd;
+    if (fd < 0) return -1;
+    while (len < sizeof(p->buf) - 1 &&
+           (rd = read(fd, p->buf + len, sizeof(p->buf) - 1 - len)) > 0)
+        len += (size_t) rd;
+    close(fd);
+    p->buf[len] = '\0';
+    return len ? 0 : -1;
+}
+
+static const char *next_line(const char *s) {
+    const char *eol = strchr(s, '\n');
+    return eol ? eol + 1 : NULL;
+}
+
+/**
+ * Look up a field of the snmp and netstat files, where each group is a
+ * header line of names followed by a line of values, both starting with
+ * the same prefix, e.g. `Tcp:`.
+ * @return Zero if found, non-zero if not.
+ */
+static int proc_field(const char *buf, const char *prefix, const char *name,
+                      uint64_t *out) {
+    size_t plen = strlen(prefix), nlen = strlen(name);
+    for (const char *line = buf; line; line = next_line(line)) {
+        if (strncmp(line, prefix, plen) != 0) continue;
+        const char *values = next_line(line);
+        if (!values || strncmp(values, prefix, plen) != 0) return -1;
+        const char *h = line + plen, *v = values + plen;
+        while (1) {
+            while (*h == ' ') ++h;
+            while (*v == ' ') ++v;
+            if (*h == '\n' || *h == '\0' || *v == '\n' || *v == '\0')
+                return -1;
+            size_t hl = strcspn(h, " \n");
+            if (hl == nlen && strncmp(h, name, nlen) == 0) {
+                *out = strtoull(v, NULL, 10);
+                return 0;
+            }
+            h += hl;
+            v += strcspn(v, " \n");
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find the interface of the default route with the lowest metric.
+ * @param name set to the interface, or empty if there is no default route.
+ */
+static void default_route(const char *buf, char name[IFNAMSIZ]) {
+    int best = -1;
+    name[0] = '\0';
+    for (const char *line = next_line(buf); line; line = next_line(line)) {
+        char iface[IFNAMSIZ];
+        unsigned long dest, mask;
+        unsigned int flags;
+        int metric;
+        if (sscanf(line, "%15s %lx %*x %x %*d %*d %d %lx", iface, &dest,
+                   &flags, &metric, &mask) != 5)
+            continue;
+        // RTF_UP
+        if (dest != 0 || mask != 0 || !(flags & 1)) continue;
+        if (best < 0 || metric < best) {
+            best = metric;
+            strcpy(name, iface);
+        }
+    }
+}
+
+/**
+ * Take received bytes and packets of the given interface.
+ */
+static void sum_dev(const char *buf, const char *iface,
+                    struct passive_counters *c) {
+    size_t len = strlen(iface);
+    const char *line = next_line(buf);
+    if (line) line = next_line(line); // two header lines
+    for (; line && len > 0; line = next_line(line)) {
+        const char *colon = strchr(line, ':');
+        const char *eol = strchr(line, '\n');
+        if (!colon || (eol && colon > eol)) continue;
+        const char *name = line;
+        while (*name == ' ') ++name;
+        if ((size_t) (colon - name) != len || strncmp(name, iface, len) != 0)
+            continue;
+        char *end;
+        c->rx_bytes = strtoull(colon + 1, &end, 10);
+        c->rx_packets = strtoull(end, NULL, 10);
+        return;
+    }
+}
+
+/**
+ * Read the current counters.
+ * @return Zero if success, non-zero if the counters are not available.
+ */
+int passive_read(struct passive *p, struct passive_counters *c) {
+    memset(c, 0, sizeof(*c));
+    if (p->iface[0] != '\0') strcpy(c->iface, p->iface);
+    else if (slurp(p, "/proc/net/route") == 0) default_route(p->buf, c->iface);
+    if (slurp(p, "/proc/net/snmp") ||
+        proc_field(p->buf, "Tcp:", "InSegs", &c->tcp_in_segs) ||
+        proc_field(p->buf, "Tcp:", "OutSegs", &c->tcp_out_segs) ||
+        proc_field(p->buf, "Tcp:", "RetransSegs", &c->tcp_retrans_segs) ||
+        proc_field(p->buf, "Icmp:", "InDestUnreachs", &c->icmp_unreach))
+        return -1;
+    // optional, not every kernel has it
+    if (slurp(p, "/proc/net/netstat") == 0)
+        proc_field(p->buf, "TcpExt:", "TCPTimeouts", &c->tcp_timeouts);
+    if (slurp(p, "/proc/net/dev")) return -1;
+    sum_dev(p->buf, c->iface, c);
+    return 0;
+}
+
+const char *passive_verdict_name(enum passive_verdict v) {
+    switch (v) {
+        case PASSIVE_HEALTHY:
+            return "healthy";
+        case PASSIVE_BAD:
+            return "bad";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Take a sample and judge the window since the previous one. Samples
+ * taken less than a second apart return the previous verdict.
+ * @param logger the logger.
+ * @param p the sampler.
+ * @param now_us monotonic time in microseconds.
+ * @return The verdict of the last window.
+ */
+enum passive_verdict passive_sample(void *logger, struct passive *p,
+                                    long long now_us) {
+    struct passive_counters c;
+    if (p->valid && now_us - p->last_us < 1000000LL) return p->verdict;
+    if (passive_read(p, &c)) {
+        p->valid = 0;
+        p->verdict = PASSIVE_UNKNOWN;
+        return p->verdict;
+    }
+    if (!p->valid || strcmp(c.iface, p->last.iface) != 0) {
+        // counters of another interface say nothing about this window
+        if (strcmp(c.iface, p->last.iface) != 0) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "Passive signals count rx on %s.",
+                     c.iface[0] ? c.iface : "no interface");
+            log_info(logger, buf);
+        }
+        p->valid = 1;
+        p->last = c;
+        p->last_us = now_us;
+        return p->verdict = PASSIVE_UNKNOWN;
+    }
+    uint64_t rx = c.rx_packets - p->last.rx_packets;
+    uint64_t in = c.tcp_in_segs - p->last.tcp_in_segs;
+    uint64_t out = c.tcp_out_segs - p->last.tcp_out_segs;
+    uint64_t retrans = c.tcp_retrans_segs - p->last.tcp_retrans_segs;
+    uint64_t unreach = c.icmp_unreach - p->last.icmp_unreach;
+    uint64_t timeouts = c.tcp_timeouts - p->last.tcp_timeouts;
+    // per mille of sent segments that were retransmissions
+    uint64_t ratio = out ? retrans * 1000 / out : 0;
+    enum passive_verdict v = PASSIVE_UNKNOWN;
+    if ((out >= PASSIVE_BAD_MIN_SEGS &&
+         (ratio >= PASSIVE_BAD_RETRANS || in == 0)) ||
+        unreach >= PASSIVE_BAD_UNREACH || timeouts >= PASSIVE_BAD_TIMEOUTS) {
+        v = PASSIVE_BAD;
+    } else if (rx >= PASSIVE_HEALTHY_RX_PACKETS && in > 0 &&
+               ratio <= PASSIVE_HEALTHY_RETRANS) {
+        v = PASSIVE_HEALTHY;
+    }
+    if (v != p->verdict) {
+        char buf[192];
+        snprintf(buf, sizeof(buf),
+                 "Passive signals are %s: rx %llu pkts, tcp in %llu out %llu "
+                 "retrans %llu.%llu%% timeouts %llu, icmp unreach %llu.",
+                 passive_verdict_name(v), (unsigned long long) rx,
+                 (unsigned long long) in, (unsigned long long) out,
+                 (unsigned long long) (ratio / 10),
+                 (unsigned long long) (ratio % 10),
+                 (unsigned long long) timeouts,
+                 (unsigned long long) unreach);
+        log_info(logger, buf);
+    }
+    p->last = c;
+    p->last_us = now_us;
+    return p->verdict = v;
+}
@@ -0,0 +1,67 @@
+//
+// Created by Keuin on 2022/1/14.
+//
+
+#ifndef NETMON_PASSIVE_H
+#define NETMON_PASSIVE_H
+
+#include <stdint.h>
+#include <net/if.h>
+
+// large enough for /proc/net/netstat and /proc/net/dev of a router
+#define PASSIVE_BUF_SIZE 16384
+// seconds between two samples while sleeping between checks
+#define PASSIVE_DEFAULT_TICK 5
+// active checks skipped in a row at most, so every target is still
+// probed now and then
+#define PASSIVE_DEFAULT_MAX_SKIP 10
+
+// a window is healthy if at least this many packets were received...
+#define PASSIVE_HEALTHY_RX_PACKETS 50
+// ...and at most this per mille of TCP segments were retransmitted
+#define PASSIVE_HEALTHY_RETRANS 20
+// a window is bad if TCP sent at least this many segments...
+#define PASSIVE_BAD_MIN_SEGS 20
+// ...and retransmitted at least this per mille of them, or got none back
+#define PASSIVE_BAD_RETRANS 100
+// a window is bad if this many ICMP destination unreachables arrived
+#define PASSIVE_BAD_UNREACH 10
+// a window is bad if this many TCP retransmission timers expired
+#define PASSIVE_BAD_TIMEOUTS 10
+
+enum passive_verdict {
+    PASSIVE_UNKNOWN = 0,
+    PASSIVE_HEALTHY,
+    PASSIVE_BAD,
+};
+
+struct passive_counters {
+    // the interface rx counters are of, empty if there is no default route
+    char iface[IFNAMSIZ];
+    uint64_t rx_bytes;
+    uint64_t rx_packets;
+    uint64_t tcp_in_segs;
+    uint64_t tcp_out_segs;
+    uint64_t tcp_retrans_segs;
+    uint64_t tcp_timeouts;
+    uint64_t icmp_unreach;
+};
+
+struct passive {
+    // interface whose traffic counts, empty to follow the default route
+    char iface[IFNAMSIZ];
+    int valid;
+    long long last_us;
+    struct passive_counters last;
+    enum passive_verdict verdict;
+    char buf[PASSIVE_BUF_SIZE];
+};
+
+int passive_read(struct passive *p, struct passive_counters *c);
+
+enum passive_verdict passive_sample(void *logger, struct passive *p,
+                                    long long now_us);
+
+const char *passive_verdict_name(enum passive_verdict v);
+
+#endif //NETMON_PASSIVE_H
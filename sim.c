@@ -0,0 +1,226 @@
+//
+// Created by Keuin on 2022/1/12.
+//
+// Simulation mode: run the real monitor logic against a virtual clock and
+// a trace of network states, and report how well the detection policy
+// (check interval, max failures, failure sleep) does on it.
+//
+// A trace is a text file, one event per line:
+//
+//   <time> <up|ok|down|fail> [rtt_us]
+//
+// The network is in the given state from <time> (seconds, may be
+// fractional or a unix timestamp) until the next line; the last line
+// marks the end of the trace. Files written by `--record` are traces.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "logging.h"
+#include "sim.h"
+
+static int parse_line(const char *line, double *t, int *up, long *rtt) {
+    char state[16];
+    int n = sscanf(line, "%lf %15s %ld", t, state, rtt);
+    if (n < 2) return -1;
+    if (n < 3) *rtt = SIM_DEFAULT_RTT_US;
+    if (!strcmp(state, "up") || !strcmp(state, "ok") || !strcmp(state, "1"))
+        *up = 1;
+    else if (!strcmp(state, "down") || !strcmp(state, "fail") ||
+             !strcmp(state, "0"))
+        *up = 0;
+    else return -1;
+    return 0;
+}
+
+static int is_blank(const char *line) {
+    while (*line == ' ' || *line == '\t') ++line;
+    return *line == '#' || *line == '\n' || *line == '\r' || *line == '\0';
+}
+
+/**
+ * @return Bytes needed to hold the trace, or 0 if it cannot be read.
+ */
+size_t sim_footprint(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    size_t n = 0;
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!is_blank(line)) ++n;
+    }
+    fclose(fp);
+    return n * sizeof(struct sim_event);
+}
+
+/**
+ * Load a trace into the arena. timeout_us and min_outage_us must be set
+ * before.
+ * @param size bytes reserved for the trace, the sim_footprint() taken
+ * before. Events beyond it are ignored, so a trace that grew since then
+ * never overruns the reservation.
+ * @return Zero if success, non-zero if failed.
+ */
+int sim_load(void *logger, struct sim *s, const char *path, size_t size) {
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    size_t cap = size / sizeof(struct sim_event);
+    double first = 0;
+    if (!fp || cap < 2) {
+        log_error(logger, "Trace is unreadable or has less than two events.");
+        if (fp) fclose(fp);
+        return -1;
+    }
+    if ((s->events = arena_alloc(cap * sizeof(struct sim_event))) == NULL) {
+        log_error(logger, "Cannot allocate the trace.");
+        fclose(fp);
+        return -1;
+    }
+    s->n_events = 0;
+    while (fgets(line, sizeof(line), fp) && s->n_events < cap) {
+        double t;
+        int up;
+        long rtt;
+        if (is_blank(line)) continue;
+        if (parse_line(line, &t, &up, &rtt)) {
+            char buf[300];
+            snprintf(buf, sizeof(buf), "Invalid trace line: %s", line);
+            log_error(logger, buf);
+            fclose(fp);
+            return -1;
+        }
+        if (s->n_events == 0) first = t;
+        struct sim_event *e = &s->events[s->n_events];
+        e->t_us = (long long) ((t - first) * 1e6);
+        if (s->n_events > 0 && e->t_us < e[-1].t_us) {
+            log_error(logger, "Trace is not in time order.");
+            fclose(fp);
+            return -1;
+        }
+        e->up = up;
+        e->rtt_us = rtt;
+        ++s->n_events;
+    }
+    fclose(fp);
+    if (s->n_events < 2) {
+        log_error(logger, "Trace has less than two events.");
+        return -1;
+    }
+    // unix timestamps are kept for statistics, relative times start now
+    s->base_wall = (first > 1e9) ? (time_t) first : time(NULL);
+
+    // find runs of the same state, the end marker belongs to none
+    size_t last = s->n_events - 1;
+    for (size_t i = 0; i < last;) {
+        size_t j = i;
+        while (j < last && s->events[j].up == s->events[i].up) ++j;
+        for (size_t k = i; k < j; ++k) {
+            s->events[k].run_start_us = s->events[i].t_us;
+            s->events[k].run_end_us = s->events[j].t_us;
+        }
+        if (!s->events[i].up &&
+            s->events[j].t_us - s->events[i].t_us >= s->min_outage_us)
+            ++s->outages;
+        i = j;
+    }
+    s->now_us = 0;
+    s->cursor = 0;
+    s->last_detected_us = -1;
+    return 0;
+}
+
+static const struct sim_event *current(struct sim *s) {
+    while (s->cursor + 1 < s->n_events &&
+           s->events[s->cursor + 1].t_us <= s->now_us)
+        ++s->cursor;
+    return &s->events[s->cursor];
+}
+
+static int sim_check(struct monitor *m) {
+    struct sim *s = m->ctx;
+    const struct sim_event *e = current(s);
+    s->now_us += e->up ? e->rtt_us : s->timeout_us;
+    return e->up ? 0 : -1;
+}
+
+static long long sim_now_us(struct monitor *m) {
+    return ((struct sim *) m->ctx)->now_us;
+}
+
+static time_t sim_wall(struct monitor *m) {
+    struct sim *s = m->ctx;
+    return s->base_wall + (time_t) (s->now_us / 1000000);
+}
+
+static void sim_sleep(struct monitor *m, unsigned int seconds) {
+    ((struct sim *) m->ctx)->now_us += (long long) seconds * 1000000LL;
+}
+
+/**
+ * Classify an action: the first one in a real outage detects it, those
+ * outside of any real outage are false triggers.
+ */
+static void sim_action(struct monitor *m, const char *cmd) {
+    (void) cmd;
+    struct sim *s = m->ctx;
+    const struct sim_event *e = current(s);
+    if (e->up || e->run_end_us - e->run_start_us < s->min_outage_us) {
+        ++s->false_triggers;
+        return;
+    }
+    if (e->run_start_us == s->last_detected_us) return; // already detected
+    s->last_detected_us = e->run_start_us;
+    long long ttd = s->now_us - e->run_start_us;
+    ++s->detected;
+    s->ttd_sum_us += ttd;
+    if (ttd > s->ttd_max_us) s->ttd_max_us = ttd;
+}
+
+static const struct monitor_ops sim_ops = {
+        .check = sim_check,
+        .now_us = sim_now_us,
+        .wall = sim_wall,
+        .sleep = sim_sleep,
+        .action = sim_action,
+};
+
+/**
+ * Replay the trace through the monitor and print a report to stdout.
+ * The monitor must be initialized, its ops are replaced.
+ * @return Zero if success.
+ */
+int sim_run(struct sim *s, struct monitor *m) {
+    struct timespec t0, t1;
+    long long end_us = s->events[s->n_events - 1].t_us;
+    m->ops = &sim_ops;
+    m->ctx = s;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (s->now_us < end_us) {
+        monitor_sleep(m, monitor_step(m));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall_s = (double) (t1.tv_sec - t0.tv_sec) +
+                    (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double sim_s = (double) end_us / 1e6;
+
+    printf("Policy: check every %u s, act after %d failures, "
+           "then sleep %u s.\n",
+           m->check_interval, m->max_failure + 1, m->failure_sleep);
+    printf("Simulated %.0f s (%lu checks) in %.3f ms",
+           sim_s, m->checks, wall_s * 1e3);
+    if (wall_s > 0) printf(", %.0fx real time", sim_s / wall_s);
+    printf(".\n");
+    printf("Actions fired: %lu\n", m->actions);
+    printf("Outages (>= %lld s): %zu, detected: %zu, missed: %zu\n",
+           s->min_outage_us / 1000000, s->outages, s->detected,
+           s->outages - s->detected);
+    if (s->detected > 0) {
+        printf("Time to detect: mean %.1f s, max %.1f s\n",
+               (double) s->ttd_sum_us / (double) s->detected / 1e6,
+               (double) s->ttd_max_us / 1e6);
+    }
+    printf("False triggers: %zu\n", s->false_triggers);
+    return 0;
+}
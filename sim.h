@@ -0,0 +1,54 @@
+//
+// Created by Keuin on 2022/1/12.
+//
+
+#ifndef NETMON_SIM_H
+#define NETMON_SIM_H
+
+#include <stddef.h>
+#include "monitor.h"
+
+// RTT of a successful check if the trace does not say
+#define SIM_DEFAULT_RTT_US 20000L
+
+/**
+ * One line of a trace: from t_us on, the network is up or down.
+ */
+struct sim_event {
+    long long t_us;
+    int up;
+    long rtt_us;
+    // the run of events with the same state this event belongs to
+    long long run_start_us;
+    long long run_end_us;
+};
+
+struct sim {
+    struct sim_event *events;
+    size_t n_events;
+    // virtual monotonic clock, starts at the first event
+    long long now_us;
+    time_t base_wall;
+    size_t cursor;
+
+    // duration of a failed check, e.g. the probe timeout
+    long timeout_us;
+    // shorter down runs are blips that should not trigger the action
+    long long min_outage_us;
+
+    // results
+    size_t outages;
+    size_t detected;
+    size_t false_triggers;
+    long long ttd_sum_us;
+    long long ttd_max_us;
+    long long last_detected_us;
+};
+
+size_t sim_footprint(const char *path);
+
+int sim_load(void *logger, struct sim *s, const char *path, size_t size);
+
+int sim_run(struct sim *s, struct monitor *m);
+
+#endif //NETMON_SIM_H
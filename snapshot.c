@@ -0,0 +1,90 @@
+//
+// Created by Keuin on 2022/1/16.
+//
+// Writer side of the shared-memory health snapshot, see netmon_shm.h.
+//
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "logging.h"
+#include "monitor.h"
+#include "snapshot.h"
+
+/**
+ * Create (or take over) the snapshot file and map it.
+ * @return The region, or NULL if failed.
+ */
+struct netmon_shm *snapshot_open(void *logger, const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open()");
+        log_error(logger, "Cannot open the shared memory file.");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct netmon_shm)) < 0) {
+        perror("ftruncate()");
+        log_error(logger, "Cannot resize the shared memory file.");
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(struct netmon_shm), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap()");
+        log_error(logger, "Cannot map the shared memory file.");
+        return NULL;
+    }
+    struct netmon_shm *shm = p;
+    // the sequence stays odd until the first snapshot_publish(), so a
+    // reader never takes the cleared region for a snapshot
+    uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(&shm->pid, 0, sizeof(*shm) - offsetof(struct netmon_shm, pid));
+    shm->version = NETMON_SHM_VERSION;
+    shm->pid = (uint32_t) getpid();
+    // readers check the magic, so publish it last
+    __atomic_store_n(&shm->magic, NETMON_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+/**
+ * Publish the state of the monitor. Readers never wait for this, they
+ * retry if they catch it halfway.
+ */
+void snapshot_publish(struct netmon_shm *shm, const struct monitor *m,
+                      time_t now) {
+    // odd while writing, and already odd before the first publish
+    uint32_t seq = shm->seq | 1;
+    __atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->updated = now;
+    shm->interval = m->in_failure_sleep ? m->failure_sleep : m->check_interval;
+    shm->last_action = m->last_action;
+    shm->actions = m->actions;
+    strncpy(shm->last_action_cmd, m->last_action ? m->failcmd : "",
+            NETMON_SHM_CMD_MAX - 1);
+    shm->n_targets = m->targets ? m->targets->n : 0;
+    for (uint32_t i = 0; i < shm->n_targets; ++i) {
+        const struct target *src = &m->targets->items[i];
+        const struct target_stats *st = &m->targets->stats[i];
+        struct netmon_shm_target *t = &shm->targets[i];
+        strncpy(t->name, st->name, NETMON_SHM_NAME_MAX - 1);
+        // stats start as up, but nothing is known before the first check
+        t->up = src->last_check ? (uint32_t) st->up : 0;
+        t->consecutive_failures = src->failures;
+        t->last_rtt_us = src->last_rtt_us;
+        t->last_check = src->last_check;
+        t->last_change = st->last_change;
+        t->probes = st->total_probes;
+        t->failures = st->total_failures;
+    }
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,18 @@
+//
+// Created by Keuin on 2022/1/16.
+//
+
+#ifndef NETMON_SNAPSHOT_H
+#define NETMON_SNAPSHOT_H
+
+#include <time.h>
+#include "netmon_shm.h"
+
+struct monitor;
+
+struct netmon_shm *snapshot_open(void *logger, const char *path);
+
+void snapshot_publish(struct netmon_shm *shm, const struct monitor *m,
+                      time_t now);
+
+#endif //NETMON_SNAPSHOT_H
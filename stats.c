@@ -0,0 +1,80 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+
+#include <string.h>
+#include "stats.h"
+
+static unsigned bucket_of(unsigned long us) {
+    if (us < (1UL << RTT_SUB_BITS)) return (unsigned) us;
+    unsigned msb = 0;
+    for (unsigned long v = us; v >>= 1;) ++msb;
+    unsigned sub = (unsigned) (us >> (msb - RTT_SUB_BITS)) &
+                   ((1U << RTT_SUB_BITS) - 1);
+    unsigned b = ((msb - RTT_SUB_BITS + 1) << RTT_SUB_BITS) + sub;
+    return (b < RTT_BUCKETS) ? b : RTT_BUCKETS - 1;
+}
+
+/**
+ * @return The smallest value falling into the bucket.
+ */
+static unsigned long bucket_floor(unsigned b) {
+    if (b < (1U << RTT_SUB_BITS)) return b;
+    unsigned msb = (b >> RTT_SUB_BITS) + RTT_SUB_BITS - 1;
+    unsigned long sub = b & ((1U << RTT_SUB_BITS) - 1);
+    return (1UL << msb) | (sub << (msb - RTT_SUB_BITS));
+}
+
+void stats_init(struct target_stats *st, const char *name) {
+    memset(st, 0, sizeof(*st));
+    strncpy(st->name, name, TARGET_NAME_MAX - 1);
+    st->up = 1; // assume the network is up until a check fails
+}
+
+/**
+ * Record the outcome of a check.
+ * @param st the statistics.
+ * @param ok non-zero if the check succeeded.
+ * @param rtt_us round-trip time of a successful check, in microseconds.
+ * @param now wall clock time of the check.
+ */
+void stats_record(struct target_stats *st, int ok, long rtt_us, time_t now) {
+    ++st->probes;
+    ++st->total_probes;
+    if (ok) {
+        ++st->rtt_hist[bucket_of(rtt_us < 0 ? 0 : (unsigned long) rtt_us)];
+        ++st->rtt_count;
+    } else {
+        ++st->failures;
+        ++st->total_failures;
+    }
+    if (!ok != !st->up) {
+        st->up = ok;
+        st->last_change = now;
+        ++st->transitions;
+    }
+}
+
+/**
+ * Estimate a percentile of the RTT of this interval. The result is the
+ * lower bound of the histogram bucket, i.e. accurate to within 25%.
+ * @param pct the percentile, 0 to 100.
+ * @return The RTT in microseconds, or -1 if nothing was recorded.
+ */
+long stats_percentile(const struct target_stats *st, int pct) {
+    if (st->rtt_count == 0) return -1;
+    // rank of the wanted sample, 1-based
+    uint64_t rank = ((uint64_t) st->rtt_count * pct + 99) / 100;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < RTT_BUCKETS; ++b) {
+        seen += st->rtt_hist[b];
+        if (seen >= rank) return (long) bucket_floor(b);
+    }
+    return (long) bucket_floor(RTT_BUCKETS - 1);
+}
+
+void stats_reset_interval(struct target_stats *st) {
+    st->probes = st->failures = st->transitions = st->rtt_count = 0;
+    memset(st->rtt_hist, 0, sizeof(st->rtt_hist));
+}
@@ -0,0 +1,45 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+
+#ifndef NETMON_STATS_H
+#define NETMON_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// RTT histogram: 4 sub-buckets per power of two microseconds
+#define RTT_SUB_BITS 2
+#define RTT_BUCKETS (32 << RTT_SUB_BITS)
+
+// max length of a target name, including the terminating zero
+#define TARGET_NAME_MAX 48
+
+/**
+ * Statistics of one check target. Interval counters are cleared by
+ * stats_reset_interval() whenever a summary is taken.
+ */
+struct target_stats {
+    char name[TARGET_NAME_MAX];
+    // current state, non-zero if the last check succeeded
+    int up;
+    time_t last_change;
+    uint64_t total_probes;
+    uint64_t total_failures;
+    // counters of the current interval
+    uint32_t probes;
+    uint32_t failures;
+    uint32_t transitions;
+    uint32_t rtt_count;
+    uint32_t rtt_hist[RTT_BUCKETS];
+};
+
+void stats_init(struct target_stats *st, const char *name);
+
+void stats_record(struct target_stats *st, int ok, long rtt_us, time_t now);
+
+long stats_percentile(const struct target_stats *st, int pct);
+
+void stats_reset_interval(struct target_stats *st);
+
+#endif //NETMON_STATS_H
@@ -0,0 +1,279 @@
+//
+// Created by Keuin on 2022/1/17.
+//
+// Check targets. A monitor checks a small, fixed-capacity set of them
+// in turn, and the set may change while it runs (see control.c).
+//
+// A target is written as words, which is both how the control socket
+// takes them and how target_parse() reads them:
+//
+//   tcp
+//   ping <ip>
+//   dns <name> [<type>] [<resolver>]
+//   udp <ip[:port]> [<count>] [<rate>]
+//   https <host[:port]> [<path>]
+//
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+#include "netcheck.h"
+#include "target.h"
+#include "udpecho.h"
+#include "validate.h"
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void targets_init(struct target_set *s) {
+    memset(s, 0, sizeof(*s));
+    s->dns.fd = -1;
+}
+
+/**
+ * Name a target the way it appears in logs, telemetry and the snapshot.
+ */
+void target_name(const struct target *t, char *buf, size_t len) {
+    char ip[INET_ADDRSTRLEN];
+    switch (t->type) {
+        case TARGET_PING:
+            snprintf(buf, len, "ping:%s", t->host);
+            break;
+        case TARGET_DNS:
+            snprintf(buf, len, "dns:%s", t->host);
+            break;
+        case TARGET_UDP_ECHO:
+            inet_ntop(AF_INET, &t->addr.sin_addr, ip, sizeof(ip));
+            snprintf(buf, len, "udp:%s:%u", ip, ntohs(t->addr.sin_port));
+            break;
+        case TARGET_HTTPS:
+            if (ntohs(t->addr.sin_port) == TLS_DEFAULT_PORT)
+                snprintf(buf, len, "https:%s", t->host);
+            else
+                snprintf(buf, len, "https:%s:%u", t->host,
+                         ntohs(t->addr.sin_port));
+            break;
+        default:
+            snprintf(buf, len, "tcp");
+            break;
+    }
+}
+
+static int parse_u32(const char *s, uint32_t min, uint32_t max, uint32_t *out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < (long) min || v > (long) max)
+        return -1;
+    *out = (uint32_t) v;
+    return 0;
+}
+
+/**
+ * Parse a target written as words, see the top of this file. Omitted
+ * arguments take their defaults, the resolver is read from resolv.conf.
+ * @param t where to store the target.
+ * @param words the words, modified while parsing.
+ * @return Zero if success, non-zero if invalid.
+ */
+int target_parse(struct target *t, char *words) {
+    char *save = NULL;
+    const char *type = strtok_r(words, " \t", &save);
+    const char *arg = strtok_r(NULL, " \t", &save);
+    const char *w;
+    memset(t, 0, sizeof(*t));
+    if (type == NULL) return -1;
+    if (strcmp(type, "tcp") == 0) {
+        t->type = TARGET_TCP;
+        return arg ? -1 : 0;
+    }
+    if (arg == NULL || strlen(arg) > DNS_MAX_NAME) return -1;
+    if (strcmp(type, "ping") == 0) {
+        t->type = TARGET_PING;
+        strcpy(t->host, arg);
+        return (is_valid_ipv4(arg) && !strtok_r(NULL, " \t", &save)) ? 0 : -1;
+    }
+    if (strcmp(type, "dns") == 0) {
+        int set = 0;
+        t->type = TARGET_DNS;
+        t->qtype = DNS_TYPE_A;
+        strcpy(t->host, arg);
+        while ((w = strtok_r(NULL, " \t", &save)) != NULL) {
+            int qtype = dns_parse_type(w);
+            if (qtype > 0) t->qtype = (uint16_t) qtype;
+            else if (dns_parse_server(w, &t->addr) == 0) set = 1;
+            else return -1;
+        }
+        return (set || dns_default_server(&t->addr) == 0) ? 0 : -1;
+    }
+    if (strcmp(type, "udp") == 0) {
+        t->type = TARGET_UDP_ECHO;
+        t->count = UDP_ECHO_DEFAULT_COUNT;
+        t->rate = UDP_ECHO_DEFAULT_RATE;
+        if (parse_ipv4_endpoint(arg, UDP_ECHO_DEFAULT_PORT, &t->addr))
+            return -1;
+        if ((w = strtok_r(NULL, " \t", &save)) != NULL &&
+            parse_u32(w, 1, UDP_ECHO_MAX_COUNT, &t->count))
+            return -1;
+        if (w && (w = strtok_r(NULL, " \t", &save)) != NULL &&
+            parse_u32(w, 1, 1000000, &t->rate))
+            return -1;
+        return (w && strtok_r(NULL, " \t", &save)) ? -1 : 0;
+    }
+#ifdef NETMON_TLS
+    if (strcmp(type, "https") == 0) {
+        uint32_t port = TLS_DEFAULT_PORT;
+        char *colon;
+        t->type = TARGET_HTTPS;
+        strcpy(t->host, arg);
+        if ((colon = strrchr(t->host, ':')) != NULL) {
+            *colon = '\0';
+            if (parse_u32(colon + 1, 1, 65535, &port)) return -1;
+        }
+        t->addr.sin_family = AF_INET;
+        t->addr.sin_port = htons((uint16_t) port);
+        w = strtok_r(NULL, " \t", &save);
+        if (w && (w[0] != '/' || strlen(w) >= TLS_PATH_MAX)) return -1;
+        strcpy(t->path, w ? w : "/");
+        return (t->host[0] == '\0' || strtok_r(NULL, " \t", &save)) ? -1 : 0;
+    }
+#endif
+    return -1;
+}
+
+/**
+ * @return Index of the target with this name, or -1 if none.
+ */
+int targets_find(const struct target_set *s, const char *name) {
+    for (unsigned i = 0; i < s->n; ++i) {
+        if (strcmp(s->stats[i].name, name) == 0) return (int) i;
+    }
+    return -1;
+}
+
+/**
+ * Add a target to the set, with fresh statistics.
+ * @return Zero if success, non-zero if the set is full or a target
+ * with the same name exists.
+ */
+int targets_add(void *logger, struct target_set *s, const struct target *t) {
+    char name[TARGET_NAME_MAX];
+    target_name(t, name, sizeof(name));
+    if (s->n >= TARGETS_MAX || targets_find(s, name) >= 0) return -1;
+    if (t->type == TARGET_TCP) netcheck_init(logger);
+    struct target *dst = &s->items[s->n];
+    *dst = *t;
+    dst->failures = 0;
+    dst->last_rtt_us = -1;
+    dst->last_check = 0;
+    dst->session = NULL;
+    stats_init(&s->stats[s->n], name);
+    ++s->n;
+    return 0;
+}
+
+/**
+ * Do the lookups a target added later may need, the TCP test host and
+ * the default resolver. They allocate, so tiny builds do them only here,
+ * before the monitor starts, and targets added on the control socket
+ * use the results.
+ */
+void targets_prepare(void *logger) {
+#ifdef NETMON_TINY
+    struct sockaddr_in addr;
+    netcheck_init(logger);
+    dns_default_server(&addr);
+#else
+    (void) logger;
+#endif
+}
+
+/**
+ * Remove a target by name. Targets after it move up one slot.
+ * @return Zero if success, non-zero if not found.
+ */
+int targets_remove(struct target_set *s, const char *name) {
+    int i = targets_find(s, name);
+    if (i < 0) return -1;
+#ifdef NETMON_TLS
+    if (s->items[i].type == TARGET_HTTPS) tls_forget(&s->items[i].session);
+#endif
+    size_t tail = s->n - (unsigned) i - 1;
+    memmove(&s->items[i], &s->items[i + 1], tail * sizeof(s->items[0]));
+    memmove(&s->stats[i], &s->stats[i + 1], tail * sizeof(s->stats[0]));
+    --s->n;
+    return 0;
+}
+
+static int check_one(void *logger, struct target_set *s, struct target *t,
+                     long *rtt_us) {
+    switch (t->type) {
+        case TARGET_DNS:
+            return check_dns(logger, &s->dns, &t->addr, t->host, t->qtype,
+                             rtt_us);
+        case TARGET_UDP_ECHO: {
+            struct udp_echo_result r;
+            memset(&r, 0, sizeof(r));
+            int rv = check_udp_echo(logger, &s->echo, &t->addr, t->count,
+                                    t->rate, &r);
+            if (r.received > 0) *rtt_us = r.rtt_avg_us;
+            return rv;
+        }
+        case TARGET_PING:
+            return check_ping(logger, t->host, NULL);
+#ifdef NETMON_TLS
+        case TARGET_HTTPS: {
+            struct tls_result r;
+            int rv = check_https(logger, t->host, ntohs(t->addr.sin_port),
+                                 t->path, &t->session, &r);
+            if (rv == 0)
+                *rtt_us = r.connect_us + r.handshake_us + r.ttfb_us;
+            return rv;
+        }
+#endif
+        default:
+            return check_tcp(logger);
+    }
+}
+
+/**
+ * Check every target once and record the outcomes in their statistics.
+ * @param logger the logger.
+ * @param s the targets.
+ * @param rtt_us store the lowest RTT of the targets that are up here,
+ * or -1 if none is.
+ * @return Zero if any target is up (or there is none), non-zero if all
+ * of them failed.
+ */
+int targets_check(void *logger, struct target_set *s, long *rtt_us) {
+    unsigned up = 0;
+    *rtt_us = -1;
+    for (unsigned i = 0; i < s->n; ++i) {
+        struct target *t = &s->items[i];
+        long rtt = -1;
+        long long t0 = monotonic_us();
+        int rv = check_one(logger, s, t, &rtt);
+        if (rtt < 0) rtt = (long) (monotonic_us() - t0);
+        t->last_check = time(NULL);
+        stats_record(&s->stats[i], rv == 0, rtt, t->last_check);
+        if (rv != 0) {
+            ++t->failures;
+            continue;
+        }
+        ++up;
+        t->failures = 0;
+        t->last_rtt_us = rtt;
+        if (*rtt_us < 0 || rtt < *rtt_us) *rtt_us = rtt;
+    }
+    if (s->n > 1) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%u of %u targets are up.",
+                 up, s->n);
+        log_debug(logger, buf);
+    }
+    return (up || s->n == 0) ? 0 : -1;
+}
@@ -0,0 +1,86 @@
+//
+// Created by Keuin on 2022/1/17.
+//
+
+#ifndef NETMON_TARGET_H
+#define NETMON_TARGET_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "dns.h"
+#include "netmon_shm.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "tls.h"
+#include "udpecho.h"
+
+// max number of targets checked by one monitor
+#define TARGETS_MAX 8
+
+#if TARGETS_MAX > TELEMETRY_MAX_TARGETS || TARGETS_MAX > NETMON_SHM_MAX_TARGETS
+#error "every target must fit into a telemetry summary and the snapshot"
+#endif
+
+enum target_type {
+    TARGET_TCP = 0,
+    TARGET_PING,
+    TARGET_DNS,
+    TARGET_UDP_ECHO,
+    TARGET_HTTPS,
+};
+
+struct target {
+    enum target_type type;
+    // ping: the IPv4 address, DNS: the name to resolve, HTTPS: the server
+    char host[DNS_MAX_NAME + 1];
+    // DNS: the resolver, UDP echo: the reflector, HTTPS: only the port
+    struct sockaddr_in addr;
+    // DNS: the record type
+    uint16_t qtype;
+    // UDP echo: packets per check, and per second
+    uint32_t count;
+    uint32_t rate;
+    // HTTPS: the path to request, and the session to resume
+    char path[TLS_PATH_MAX];
+    void *session;
+
+    // continuous failures of this target
+    int failures;
+    // RTT of the last successful check, -1 if none yet
+    long last_rtt_us;
+    time_t last_check;
+};
+
+/**
+ * All targets of a monitor. The network is up if any of them is.
+ * stats[i] belongs to items[i], so the statistics can be handed to
+ * telemetry as an array.
+ */
+struct target_set {
+    unsigned n;
+    struct target items[TARGETS_MAX];
+    struct target_stats stats[TARGETS_MAX];
+    // DNS and UDP echo targets are checked one at a time and share the
+    // probes
+    struct dns_probe dns;
+    struct udp_echo_probe echo;
+};
+
+void targets_init(struct target_set *s);
+
+void target_name(const struct target *t, char *buf, size_t len);
+
+int target_parse(struct target *t, char *words);
+
+int targets_find(const struct target_set *s, const char *name);
+
+int targets_add(void *logger, struct target_set *s, const struct target *t);
+
+void targets_prepare(void *logger);
+
+int targets_remove(struct target_set *s, const char *name);
+
+int targets_check(void *logger, struct target_set *s, long *rtt_us);
+
+#endif //NETMON_TARGET_H
@@ -0,0 +1,241 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "logging.h"
+#include "telemetry.h"
+#include "validate.h"
+
+/**
+ * Encode an unsigned integer as LEB128.
+ * @return Bytes written, or 0 if the buffer is too small.
+ */
+size_t varint_put(unsigned char *buf, size_t len, uint64_t v) {
+    size_t n = 0;
+    do {
+        if (n >= len) return 0;
+        unsigned char b = v & 0x7F;
+        v >>= 7;
+        buf[n++] = b | (v ? 0x80 : 0);
+    } while (v);
+    return n;
+}
+
+/**
+ * Decode a LEB128 unsigned integer.
+ * @return Bytes read, or 0 if the input is truncated or overlong.
+ */
+size_t varint_get(const unsigned char *buf, size_t len, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t n = 0; n < len && n < 10; ++n) {
+        r |= (uint64_t) (buf[n] & 0x7F) << (7 * n);
+        if (!(buf[n] & 0x80)) {
+            *v = r;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+struct writer {
+    unsigned char *buf;
+    size_t len, pos;
+    int overflow;
+};
+
+static void put_uint(struct writer *w, uint64_t v) {
+    size_t n = varint_put(w->buf + w->pos, w->len - w->pos, v);
+    if (n == 0) w->overflow = 1;
+    w->pos += n;
+}
+
+static void put_str(struct writer *w, const char *s, size_t max) {
+    size_t n = strnlen(s, max - 1);
+    put_uint(w, n);
+    if (w->overflow || w->len - w->pos < n) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->pos, s, n);
+    w->pos += n;
+}
+
+/**
+ * Encode the interval summary of all targets into one datagram.
+ * Targets that do not fit are left out.
+ * @return Length of the datagram, or -1 if not even the header fits.
+ */
+int telemetry_encode(unsigned char *buf, size_t len, const char *site,
+                     uint64_t boot, uint64_t seq, time_t now, unsigned int interval,
+                     const struct target_stats *stats, unsigned n) {
+    struct writer w = {buf, len, 0, 0};
+    if (len < 3) return -1;
+    buf[w.pos++] = TELEMETRY_MAGIC0;
+    buf[w.pos++] = TELEMETRY_MAGIC1;
+    buf[w.pos++] = TELEMETRY_VERSION;
+    put_str(&w, site, SITE_NAME_MAX);
+    put_uint(&w, boot);
+    put_uint(&w, seq);
+    put_uint(&w, (uint64_t) now);
+    put_uint(&w, interval);
+    if (n > TELEMETRY_MAX_TARGETS) n = TELEMETRY_MAX_TARGETS;
+    size_t count_pos = w.pos;
+    put_uint(&w, n); // n < 128, always a single byte
+    if (w.overflow) return -1;
+    unsigned written = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        const struct target_stats *st = &stats[i];
+        size_t mark = w.pos;
+        put_str(&w, st->name, TARGET_NAME_MAX);
+        put_uint(&w, st->up ? 1 : 0);
+        put_uint(&w, (uint64_t) st->last_change);
+        put_uint(&w, st->probes);
+        put_uint(&w, st->failures);
+        put_uint(&w, st->transitions);
+        put_uint(&w, (uint64_t) (stats_percentile(st, 50) + 1));
+        put_uint(&w, (uint64_t) (stats_percentile(st, 90) + 1));
+        put_uint(&w, (uint64_t) (stats_percentile(st, 99) + 1));
+        put_uint(&w, st->total_probes);
+        put_uint(&w, st->total_failures);
+        if (w.overflow) {
+            w.pos = mark;
+            break;
+        }
+        ++written;
+    }
+    buf[count_pos] = (unsigned char) written;
+    return (int) w.pos;
+}
+
+struct reader {
+    const unsigned char *buf;
+    size_t len, pos;
+    int error;
+};
+
+static uint64_t get_uint(struct reader *r) {
+    uint64_t v = 0;
+    size_t n = varint_get(r->buf + r->pos, r->len - r->pos, &v);
+    if (n == 0) r->error = 1;
+    r->pos += n;
+    return v;
+}
+
+static void get_str(struct reader *r, char *out, size_t max) {
+    uint64_t n = get_uint(r);
+    if (r->error || n >= max || r->len - r->pos < n) {
+        r->error = 1;
+        out[0] = '\0';
+        return;
+    }
+    memcpy(out, r->buf + r->pos, n);
+    out[n] = '\0';
+    r->pos += n;
+}
+
+/**
+ * Decode a datagram produced by telemetry_encode().
+ * @return Zero if success, -1 if malformed.
+ */
+int telemetry_decode(const unsigned char *buf, size_t len,
+                     struct telemetry_summary *sum) {
+    struct reader r = {buf, len, 3, 0};
+    if (len < 3 || buf[0] != TELEMETRY_MAGIC0 || buf[1] != TELEMETRY_MAGIC1 ||
+        buf[2] != TELEMETRY_VERSION)
+        return -1;
+    get_str(&r, sum->site, SITE_NAME_MAX);
+    sum->boot = get_uint(&r);
+    sum->seq = get_uint(&r);
+    sum->timestamp = get_uint(&r);
+    sum->interval = (uint32_t) get_uint(&r);
+    uint64_t n = get_uint(&r);
+    if (r.error || n > TELEMETRY_MAX_TARGETS) return -1;
+    sum->n_targets = (unsigned) n;
+    for (unsigned i = 0; i < sum->n_targets; ++i) {
+        struct telemetry_target *t = &sum->targets[i];
+        get_str(&r, t->name, TARGET_NAME_MAX);
+        t->up = (uint8_t) get_uint(&r);
+        t->last_change = get_uint(&r);
+        t->probes = (uint32_t) get_uint(&r);
+        t->failures = (uint32_t) get_uint(&r);
+        t->transitions = (uint32_t) get_uint(&r);
+        t->p50 = (long) get_uint(&r) - 1;
+        t->p90 = (long) get_uint(&r) - 1;
+        t->p99 = (long) get_uint(&r) - 1;
+        t->total_probes = get_uint(&r);
+        t->total_failures = get_uint(&r);
+    }
+    return r.error ? -1 : 0;
+}
+
+/**
+ * Prepare pushing summaries to a collector.
+ * @param logger the logger.
+ * @param t the pusher state.
+ * @param dest address of the collector.
+ * @param site name of this site.
+ * @param interval seconds between two summaries.
+ * @return Zero if success, non-zero if failed.
+ */
+int telemetry_init(void *logger, struct telemetry *t,
+                   const struct sockaddr_in *dest, const char *site,
+                   unsigned int interval) {
+    NOTNULL(t);
+    memset(t, 0, sizeof(*t));
+    t->site = site;
+    t->interval = interval;
+    t->last_push = time(NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->boot = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+    if ((t->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+    // connected, so an unreachable collector is reported by later sends
+    if (connect(t->fd, (const struct sockaddr *) dest, sizeof(*dest)) < 0) {
+        perror("connect()");
+        log_error(logger, "connect() to collector failed.");
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Push a summary if the interval has elapsed. Interval counters of all
+ * targets are reset after a summary is taken, whether or not it could
+ * be delivered.
+ * @return Zero if nothing to do or pushed, non-zero if failed.
+ */
+int telemetry_tick(void *logger, struct telemetry *t,
+                   struct target_stats *stats, unsigned n, time_t now) {
+    if (t->fd < 0 || now - t->last_push < (time_t) t->interval) return 0;
+    t->last_push = now;
+    int len = telemetry_encode(t->buf, sizeof(t->buf), t->site, t->boot,
+                               t->seq++, now, t->interval, stats, n);
+    for (unsigned i = 0; i < n; ++i) stats_reset_interval(&stats[i]);
+    if (len < 0) {
+        log_error(logger, "Telemetry summary does not fit into a datagram.");
+        return -1;
+    }
+    if (send(t->fd, t->buf, (size_t) len, 0) < 0) {
+        // a down collector must not disturb monitoring, just log it
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warning(logger, "Cannot push telemetry to collector.");
+        }
+        return -1;
+    }
+    log_debug(logger, "Telemetry summary is pushed.");
+    return 0;
+}
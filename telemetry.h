@@ -0,0 +1,90 @@
+//
+// Created by Keuin on 2022/1/10.
+//
+
+#ifndef NETMON_TELEMETRY_H
+#define NETMON_TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "stats.h"
+
+#define TELEMETRY_MAGIC0 'N'
+#define TELEMETRY_MAGIC1 'M'
+#define TELEMETRY_VERSION 2
+// keep datagrams below a typical path MTU
+#define TELEMETRY_MAX_DATAGRAM 1400
+#define TELEMETRY_MAX_TARGETS 8
+#define SITE_NAME_MAX 48
+
+/*
+ * Datagram layout. Integers are unsigned LEB128 varints, strings are a
+ * varint length followed by the bytes. RTTs are in microseconds, plus one
+ * so that zero means "no sample". Boot is the wall-clock time in
+ * microseconds at which the pusher started, it tells restarts apart.
+ *
+ *   'N' 'M' version
+ *   site boot seq timestamp interval n_targets
+ *   n_targets * {
+ *     name up last_change probes failures transitions
+ *     p50 p90 p99 total_probes total_failures
+ *   }
+ */
+
+struct telemetry_target {
+    char name[TARGET_NAME_MAX];
+    uint8_t up;
+    uint64_t last_change;
+    uint32_t probes;
+    uint32_t failures;
+    uint32_t transitions;
+    // -1 if no sample
+    long p50, p90, p99;
+    uint64_t total_probes;
+    uint64_t total_failures;
+};
+
+struct telemetry_summary {
+    char site[SITE_NAME_MAX];
+    uint64_t boot;
+    uint64_t seq;
+    uint64_t timestamp;
+    uint32_t interval;
+    unsigned n_targets;
+    struct telemetry_target targets[TELEMETRY_MAX_TARGETS];
+};
+
+/**
+ * State of the periodic summary pusher.
+ */
+struct telemetry {
+    int fd;
+    const char *site;
+    unsigned int interval;
+    uint64_t boot;
+    uint64_t seq;
+    time_t last_push;
+    unsigned char buf[TELEMETRY_MAX_DATAGRAM];
+};
+
+size_t varint_put(unsigned char *buf, size_t len, uint64_t v);
+
+size_t varint_get(const unsigned char *buf, size_t len, uint64_t *v);
+
+int telemetry_encode(unsigned char *buf, size_t len, const char *site,
+                     uint64_t boot, uint64_t seq, time_t now, unsigned int interval,
+                     const struct target_stats *stats, unsigned n);
+
+int telemetry_decode(const unsigned char *buf, size_t len,
+                     struct telemetry_summary *sum);
+
+int telemetry_init(void *logger, struct telemetry *t,
+                   const struct sockaddr_in *dest, const char *site,
+                   unsigned int interval);
+
+int telemetry_tick(void *logger, struct telemetry *t,
+                   struct target_stats *stats, unsigned n, time_t now);
+
+#endif //NETMON_TELEMETRY_H
@@ -0,0 +1,156 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// DNS probe against a stub resolver on loopback. The stub answers by the
+// first label of the name:
+//
+//   ok        one A record
+//   nx        NXDOMAIN
+//   mismatch  a reply with another id first, then the real one
+//   tc        truncated over UDP, one A record over TCP
+//   big       truncated over UDP, 16 KiB of A records over TCP
+//
+
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "dns.h"
+#include "test.h"
+
+// A records in the reply to `big`
+#define BIG_ANSWERS 1000
+
+static unsigned char reply[2 + 65535];
+
+/**
+ * Build the reply to a query into reply + 2.
+ * @return Length of the reply.
+ */
+static size_t answer(const unsigned char *q, size_t qlen, int tcp) {
+    unsigned char *r = reply + 2;
+    const char *label = (const char *) q + DNS_HEADER_SIZE + 1;
+    size_t llen = q[DNS_HEADER_SIZE];
+    int answers = 1, rcode = 0, tc = 0;
+    if (llen == 2 && !strncmp(label, "nx", 2)) {
+        answers = 0;
+        rcode = DNS_RCODE_NXDOMAIN;
+    } else if ((llen == 2 && !strncmp(label, "tc", 2)) ||
+               (llen == 3 && !strncmp(label, "big", 3))) {
+        if (!tcp) {
+            answers = 0;
+            tc = 1;
+        } else if (llen == 3) {
+            answers = BIG_ANSWERS;
+        }
+    }
+    memcpy(r, q, qlen);
+    r[2] = (unsigned char) (0x80 | (tc ? 0x02 : 0) | (q[2] & 0x01));
+    r[3] = (unsigned char) (0x80 | rcode);
+    r[6] = (unsigned char) (answers >> 8);
+    r[7] = (unsigned char) answers;
+    size_t len = qlen;
+    for (int i = 0; i < answers; ++i) {
+        static const unsigned char rr[] = {0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0, 60,
+                                           0, 4, 127, 0, 0, 1};
+        memcpy(r + len, rr, sizeof(rr));
+        len += sizeof(rr);
+    }
+    reply[0] = (unsigned char) (len >> 8);
+    reply[1] = (unsigned char) len;
+    return len;
+}
+
+static void serve_tcp(int fd) {
+    unsigned char q[2 + DNS_MAX_QUERY];
+    size_t got = 0;
+    ssize_t rd;
+    while ((rd = recv(fd, q + got, sizeof(q) - got, 0)) > 0) {
+        got += (size_t) rd;
+        if (got >= 2 && got >= 2 + (size_t) ((q[0] << 8) | q[1])) break;
+    }
+    if (got > 2) {
+        size_t len = answer(q + 2, got - 2, 1);
+        send(fd, reply, len + 2, MSG_NOSIGNAL);
+    }
+    close(fd);
+}
+
+static void stub(int udp, int tcp) {
+    listen(tcp, 4);
+    while (1) {
+        struct pollfd pfds[2] = {{udp, POLLIN, 0}, {tcp, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) continue;
+        if (pfds[1].revents) {
+            int fd = accept(tcp, NULL, NULL);
+            if (fd >= 0) serve_tcp(fd);
+        }
+        if (pfds[0].revents) {
+            unsigned char q[DNS_MAX_QUERY];
+            struct sockaddr_in from;
+            socklen_t flen = sizeof(from);
+            ssize_t rd = recvfrom(udp, q, sizeof(q), 0,
+                                  (struct sockaddr *) &from, &flen);
+            if (rd < DNS_HEADER_SIZE + 2) continue;
+            size_t len = answer(q, (size_t) rd, 0);
+            if (q[DNS_HEADER_SIZE] == 8 &&
+                !memcmp(q + DNS_HEADER_SIZE + 1, "mismatch", 8)) {
+                reply[3] ^= 0xFF; // another id
+                sendto(udp, reply + 2, len, 0, (struct sockaddr *) &from, flen);
+                reply[3] ^= 0xFF;
+            }
+            sendto(udp, reply + 2, len, 0, (struct sockaddr *) &from, flen);
+        }
+    }
+}
+
+int main(void) {
+    static struct dns_probe probe;
+    struct sockaddr_in server, tcpaddr;
+    long latency = -1;
+    void *logger = test_init(0);
+    int udp = test_bind(SOCK_DGRAM, &server);
+    int tcp = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    tcpaddr = server;
+    if (tcp < 0 || bind(tcp, (struct sockaddr *) &tcpaddr, sizeof(tcpaddr)) < 0)
+        die("Cannot bind the TCP port of the stub.\n");
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) {
+        stub(udp, tcp);
+        _exit(0);
+    }
+    close(udp);
+    close(tcp);
+
+    CHECK(check_dns(logger, &probe, &server, "ok.test", DNS_TYPE_A,
+                    &latency) == 0);
+    CHECK(latency >= 0);
+    CHECK(probe.result.matched == 1 && probe.received == 0);
+
+    CHECK(check_dns(logger, &probe, &server, "nx.test", DNS_TYPE_A, NULL) != 0);
+    CHECK(probe.result.rcode == DNS_RCODE_NXDOMAIN);
+
+    // the reply with the wrong id is skipped, not taken as an error
+    CHECK(check_dns(logger, &probe, &server, "mismatch.test", DNS_TYPE_A,
+                    NULL) == 0);
+
+    CHECK(check_dns(logger, &probe, &server, "tc.test", DNS_TYPE_A, NULL) == 0);
+    CHECK(probe.result.matched == 1 && probe.received > 0);
+
+    // only the first DNS_MAX_RESPONSE bytes are kept, the rest is read
+    CHECK(check_dns(logger, &probe, &server, "big.test", DNS_TYPE_A,
+                    NULL) == 0);
+    CHECK(probe.received > DNS_MAX_RESPONSE);
+    CHECK(probe.result.answers == BIG_ANSWERS && probe.result.matched > 0);
+
+    // the query type has to match
+    CHECK(check_dns(logger, &probe, &server, "ok.test", DNS_TYPE_AAAA,
+                    NULL) != 0);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    log_free(logger);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// Latency under load against a sink on loopback: one measurement on its
+// own, one cut short, and measurements scheduled by a monitor running
+// on a virtual wall clock.
+//
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "load.h"
+#include "monitor.h"
+#include "test.h"
+
+static struct load l;
+static int serve_calls;
+// the serve hook cuts the measurement short after this many calls
+static int serve_limit;
+
+static int count_serve(void *arg) {
+    (void) arg;
+    return ++serve_calls > serve_limit;
+}
+
+static int check_ok = 1;
+static time_t wall;
+
+static int fake_check(struct monitor *m) {
+    (void) m;
+    return check_ok ? 0 : -1;
+}
+
+static time_t fake_wall(struct monitor *m) {
+    (void) m;
+    return wall;
+}
+
+static void fake_sleep(struct monitor *m, unsigned int seconds) {
+    (void) m;
+    wall += seconds;
+}
+
+static void fake_action(struct monitor *m, const char *cmd) {
+    (void) m;
+    (void) cmd;
+}
+
+static const struct monitor_ops ops = {
+        .check = fake_check,
+        .now_us = monitor_real_now_us,
+        .wall = fake_wall,
+        .sleep = fake_sleep,
+        .action = fake_action,
+};
+
+static double seconds_since(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double) (t1.tv_sec - t0->tv_sec) +
+           (double) (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int main(void) {
+    static struct monitor m;
+    struct sockaddr_in addr;
+    struct timespec t0;
+    void *logger = test_init(sink_footprint());
+    // the sink takes TCP and UDP of the same port, find a free one
+    close(test_bind(SOCK_STREAM, &addr));
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) _exit(sink_run(logger, ntohs(addr.sin_port)));
+    int up = 0;
+    for (int i = 0; i < 100 && !up; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        up = connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+        close(fd);
+        if (!up) nanosleep(&(struct timespec) {0, 20 * 1000 * 1000}, NULL);
+    }
+    if (!up) die("The sink did not start.\n");
+
+    // loaded RTT is sampled only after LOAD_RAMP_MS
+    CHECK(load_init(logger, &l, &addr, 2, 2) == 0);
+    l.serve = count_serve;
+    serve_limit = 1 << 30;
+    CHECK(load_run(logger, &l) == 0);
+    CHECK(l.last.when != 0);
+    CHECK(l.last.probes > 0 && l.last.lost <= l.last.probes / 10);
+    CHECK(l.last.idle_p50 >= 0 && l.last.loaded_p50 >= 0);
+    CHECK(l.last.throughput_bps > 0);
+    // once per probe
+    CHECK(serve_calls > 0 && (uint32_t) serve_calls <= l.last.probes + 1);
+
+    // the hook cuts it short
+    serve_calls = 0;
+    serve_limit = 10;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    CHECK(load_run(logger, &l) != 0);
+    CHECK(seconds_since(&t0) < 1.0);
+
+    // scheduled by the monitor, not before one interval has passed
+    monitor_init(&m, logger, &ops, NULL);
+    m.check_interval = 30;
+    m.load = &l;
+    m.load_every = 100;
+    l.last.when = 0;
+    wall = 1000000;
+    for (int i = 0; i < 4; ++i) monitor_sleep(&m, monitor_step(&m));
+    CHECK(l.last.when == 0 && wall == 1000000 + 4 * 30);
+    // due at the fifth sleep
+    monitor_sleep(&m, monitor_step(&m));
+    CHECK(l.last.when != 0 && l.last.throughput_bps > 0);
+    CHECK(l.serve != NULL && l.serve_arg == &m);
+    // the measurement takes part of the sleep, not more
+    CHECK(wall < 1000000 + 5 * 30);
+
+    // never while the network is down
+    l.last.when = 0;
+    check_ok = 0;
+    wall += 1000;
+    monitor_sleep(&m, monitor_step(&m));
+    CHECK(l.last.when == 0);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    log_free(logger);
+    return test_failures ? 1 : 0;
+}
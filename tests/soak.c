@@ -0,0 +1,174 @@
+//
+// Created by Keuin on 2022/1/20.
+//
+// Soak test of the tiny profile: run the monitor for many cycles against
+// a UDP reflector on loopback and fail if the resident set grows after
+// warm-up. Every check opens a socket, logs, updates statistics, the
+// snapshot and telemetry, so a leak anywhere on that path shows up.
+// A virtual clock keeps the run fast; failures are injected now and then
+// so the failure action and the log coalescing are covered too.
+//
+//   netmon_soak <cycles> <scratch_prefix>
+//
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "arena.h"
+#include "logging.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "target.h"
+#include "telemetry.h"
+#include "udpecho.h"
+
+#ifndef NETMON_TINY
+#error "the soak test checks the tiny profile"
+#endif
+
+// cycles run before the resident set is sampled for the first time
+#define SOAK_WARMUP_DIVISOR 10
+// every this many cycles, fail enough checks in a row to run the action
+#define SOAK_OUTAGE_EVERY 50000
+
+struct soak {
+    unsigned long cycle;
+    long long now_us;
+    time_t base_wall;
+    unsigned long actions;
+};
+
+static int soak_check(struct monitor *m) {
+    struct soak *s = m->ctx;
+    unsigned long phase = s->cycle++ % SOAK_OUTAGE_EVERY;
+    s->now_us += 1000;
+    if (phase > 0 && phase <= (unsigned long) m->max_failure + 1) return -1;
+    return targets_check(m->logger, m->targets, &m->rtt_us);
+}
+
+static long long soak_now_us(struct monitor *m) {
+    return ((struct soak *) m->ctx)->now_us;
+}
+
+static time_t soak_wall(struct monitor *m) {
+    struct soak *s = m->ctx;
+    return s->base_wall + (time_t) (s->now_us / 1000000);
+}
+
+static void soak_sleep(struct monitor *m, unsigned int seconds) {
+    ((struct soak *) m->ctx)->now_us += (long long) seconds * 1000000LL;
+}
+
+static void soak_action(struct monitor *m, const char *cmd) {
+    (void) cmd;
+    ++((struct soak *) m->ctx)->actions;
+}
+
+static const struct monitor_ops soak_ops = {
+        .check = soak_check,
+        .now_us = soak_now_us,
+        .wall = soak_wall,
+        .sleep = soak_sleep,
+        .action = soak_action,
+};
+
+int main(int argc, char **argv) {
+    if (argc != 3) die("Usage: %s <cycles> <scratch_prefix>\n", argv[0]);
+    char *end;
+    unsigned long cycles = strtoul(argv[1], &end, 10);
+    if (*end != '\0' || cycles < SOAK_WARMUP_DIVISOR)
+        die("Invalid cycle count: %s\n", argv[1]);
+    char logfile[256], shmfile[256];
+    snprintf(logfile, sizeof(logfile), "%s.log", argv[2]);
+    snprintf(shmfile, sizeof(shmfile), "%s.shm", argv[2]);
+
+    arena_reserve(log_footprint());
+    arena_reserve(sizeof(struct monitor));
+    arena_reserve(sizeof(struct target_set));
+    arena_reserve(sizeof(struct telemetry));
+    arena_reserve(reflector_footprint());
+    if (arena_init()) die("Cannot allocate %zu bytes of memory.\n", arena_size());
+
+    void *logger = log_init(logfile);
+    if (logger == NULL) die("Cannot open log file: %s\n", logfile);
+    struct log_options logopts = {0, 256 * 1024, 0, 1, 0};
+    log_set_options(logger, &logopts);
+
+    // the reflector runs in a child on a port derived from the pid, so
+    // parallel test runs do not collide
+    uint16_t port = (uint16_t) (20000 + getpid() % 20000);
+    pid_t reflector = fork();
+    if (reflector < 0) die("fork() failed.\n");
+    if (reflector == 0) {
+        reflector_run(logger, port);
+        _exit(1);
+    }
+
+    struct soak s;
+    memset(&s, 0, sizeof(s));
+    s.base_wall = time(NULL);
+    struct monitor *m = arena_alloc(sizeof(struct monitor));
+    struct target_set *targets = arena_alloc(sizeof(struct target_set));
+    struct telemetry *telemetry = arena_alloc(sizeof(struct telemetry));
+    monitor_init(m, logger, &soak_ops, &s);
+    m->check_interval = 1;
+    m->max_failure = 3;
+    m->failure_sleep = 1;
+    m->failcmd = "true";
+    targets_init(targets);
+    struct target t;
+    memset(&t, 0, sizeof(t));
+    t.type = TARGET_UDP_ECHO;
+    t.addr.sin_family = AF_INET;
+    t.addr.sin_port = htons(port);
+    t.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    t.count = 1;
+    t.rate = 1000;
+    targets_add(logger, targets, &t);
+    m->targets = targets;
+    // nobody listens on the discard port, the datagrams are just dropped
+    struct sockaddr_in sink = {
+            .sin_family = AF_INET,
+            .sin_port = htons(9),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (telemetry_init(logger, telemetry, &sink, "soak", 60))
+        die("Cannot set up telemetry push.\n");
+    m->telemetry = telemetry;
+    if ((m->shm = snapshot_open(logger, shmfile)) == NULL)
+        die("Cannot publish snapshot to: %s\n", shmfile);
+
+    unsigned long warmup = cycles / SOAK_WARMUP_DIVISOR;
+    long rss_warm = 0;
+    for (unsigned long i = 0; i < cycles; ++i) {
+        monitor_sleep(m, monitor_step(m));
+        if (i + 1 == warmup) rss_warm = rss_bytes();
+    }
+    long rss_end = rss_bytes();
+
+    kill(reflector, SIGTERM);
+    waitpid(reflector, NULL, 0);
+    log_free(logger);
+    unlink(shmfile);
+    printf("cycles %lu checks %lu actions %lu rss after warm-up %ld KiB, "
+           "at end %ld KiB\n", cycles, m->checks, s.actions,
+           rss_warm / 1024, rss_end / 1024);
+    if (rss_warm <= 0 || rss_end <= 0) {
+        fprintf(stderr, "Cannot read the resident set size.\n");
+        return 1;
+    }
+    if (s.actions == 0 || targets->stats[0].total_probes == 0) {
+        fprintf(stderr, "The monitor did not run as expected.\n");
+        return 1;
+    }
+    if (rss_end > rss_warm) {
+        fprintf(stderr, "Resident set grew by %ld KiB.\n",
+                (rss_end - rss_warm) / 1024);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// Telemetry pushed to a collector on loopback, then read back through its
+// query port. Also feeds the collector hand-made summaries of a site that
+// restarts and loses its first summary afterwards.
+//
+
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "collector.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "test.h"
+
+static char answer[COLLECTOR_REPLY_MAX + 1];
+
+/**
+ * Ask the collector about a site.
+ * @return Zero if an answer was read into `answer`.
+ */
+static int query(const struct sockaddr_in *addr, const char *site) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    char line[COLLECTOR_QUERY_MAX];
+    int len = snprintf(line, sizeof(line), "%s\n", site);
+    send(fd, line, (size_t) len, MSG_NOSIGNAL);
+    size_t got = 0;
+    ssize_t rd;
+    while (got < sizeof(answer) - 1 &&
+           (rd = recv(fd, answer + got, sizeof(answer) - 1 - got, 0)) > 0)
+        got += (size_t) rd;
+    answer[got] = '\0';
+    close(fd);
+    return 0;
+}
+
+/**
+ * Query until the answer contains `want`, the collector may not have
+ * taken the datagrams yet.
+ */
+static int wait_for(const struct sockaddr_in *addr, const char *site,
+                    const char *want) {
+    for (int i = 0; i < 100; ++i) {
+        if (query(addr, site) == 0 && strstr(answer, want)) return 1;
+        nanosleep(&(struct timespec) {0, 20 * 1000 * 1000}, NULL);
+    }
+    fprintf(stderr, "no \"%s\" in the answer:\n%s", want, answer);
+    return 0;
+}
+
+static void push(int fd, const struct sockaddr_in *addr, uint64_t boot,
+                 uint64_t seq) {
+    unsigned char buf[TELEMETRY_MAX_DATAGRAM];
+    int len = telemetry_encode(buf, sizeof(buf), "restarting", boot, seq,
+                               time(NULL), 1, NULL, 0);
+    sendto(fd, buf, (size_t) len, 0, (const struct sockaddr *) addr,
+           sizeof(*addr));
+}
+
+int main(void) {
+    static struct telemetry t;
+    static struct target_stats st;
+    struct sockaddr_in addr;
+    void *logger = test_init(collector_footprint(16));
+    // the collector takes UDP and TCP of the same port, find a free one
+    close(test_bind(SOCK_DGRAM, &addr));
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) _exit(collector_run(logger, ntohs(addr.sin_port), 16));
+    // summaries sent before it listens would be lost
+    CHECK(wait_for(&addr, "", "collector sites 0 "));
+
+    // a summary pushed by the monitor
+    stats_init(&st, "gw");
+    time_t now = time(NULL);
+    for (int i = 0; i < 10; ++i) stats_record(&st, i != 3, 1000 + i, now);
+    CHECK(telemetry_init(logger, &t, &addr, "site-a", 1) == 0);
+    CHECK(telemetry_tick(logger, &t, &st, 1, t.last_push + 1) == 0);
+    CHECK(wait_for(&addr, "site-a", "site site-a "));
+    CHECK(strstr(answer, " seq 0 datagrams 1 lost 0 restarts 0 targets 1"));
+    CHECK(strstr(answer, "target gw up 1 "));
+    CHECK(strstr(answer, " probes 10 failures 1 "));
+    // the interval counters start over once pushed
+    CHECK(st.probes == 0);
+
+    // an unknown site is told so
+    CHECK(query(&addr, "nowhere") == 0 && strstr(answer, "unknown site "));
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    for (uint64_t seq = 0; seq < 3; ++seq) push(fd, &addr, 1, seq);
+    CHECK(wait_for(&addr, "restarting", " seq 2 datagrams 3 "));
+    // a replay is dropped
+    push(fd, &addr, 1, 1);
+    // restarted, and the summary with sequence number zero is lost
+    push(fd, &addr, 2, 1);
+    CHECK(wait_for(&addr, "restarting", " seq 1 datagrams 4 "));
+    CHECK(strstr(answer, " lost 1 restarts 1 "));
+    push(fd, &addr, 2, 2);
+    CHECK(wait_for(&addr, "restarting", " seq 2 datagrams 5 lost 1 "));
+    close(fd);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    log_free(logger);
+    return test_failures ? 1 : 0;
+}
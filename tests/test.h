@@ -0,0 +1,63 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// Helpers shared by the behaviour tests. Each test is a program talking
+// to loopback peers it starts itself, and exits with zero if every
+// CHECK held.
+//
+
+#ifndef NETMON_TEST_H
+#define NETMON_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "arena.h"
+#include "logging.h"
+
+// exit code telling ctest the test was skipped, e.g. a tool is missing
+#define TEST_SKIPPED 77
+
+static int test_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            ++test_failures; \
+        } \
+    } while (0)
+
+/**
+ * Set up the arena and a logger writing to stderr.
+ * @param extra bytes the test allocates from the arena itself.
+ */
+static inline void *test_init(size_t extra) {
+    arena_reserve(log_footprint());
+    arena_reserve(extra);
+    if (arena_init()) die("Cannot allocate %zu bytes of memory.\n", arena_size());
+    void *logger = log_init(NULL);
+    if (logger == NULL) die("Cannot create the logger.\n");
+    return logger;
+}
+
+/**
+ * Bind a socket to an ephemeral port on loopback.
+ * @return The socket, the port is stored into addr.
+ */
+static inline int test_bind(int type, struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *) addr, &len) < 0)
+        die("Cannot bind a loopback socket.\n");
+    return fd;
+}
+
+#endif //NETMON_TEST_H
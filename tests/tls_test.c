@@ -0,0 +1,130 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// HTTPS check against `openssl s_server -www`, with a certificate issued
+// by a throwaway CA for localhost and 127.0.0.1. Skipped if the openssl
+// command is not installed.
+//
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "tls.h"
+#include "test.h"
+
+static char dir[] = "/tmp/netmon-tls-XXXXXX";
+
+/**
+ * Run a shell command. Up to six %s in fmt all stand for arg.
+ * @return The status of the command.
+ */
+static int run(const char *fmt, const char *arg) {
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), fmt, arg, arg, arg, arg, arg, arg);
+    return system(cmd);
+}
+
+/**
+ * Create the CA and the server certificate in `dir`.
+ * @return Zero if success.
+ */
+static int make_certs(void) {
+    static const char *const cmds[] = {
+            "openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 "
+            "-nodes -days 1 -subj /CN=netmon-test-ca -keyout %s/ca.key "
+            "-out %s/ca.pem",
+            "openssl req -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes "
+            "-subj /CN=localhost -keyout %s/server.key -out %s/server.csr",
+            "echo subjectAltName=DNS:localhost,IP:127.0.0.1 > %s/ext.cnf",
+            "openssl x509 -req -days 1 -in %s/server.csr -CA %s/ca.pem "
+            "-CAkey %s/ca.key -CAcreateserial -extfile %s/ext.cnf "
+            "-out %s/server.pem",
+    };
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
+        char fmt[512];
+        snprintf(fmt, sizeof(fmt), "%s 2>/dev/null", cmds[i]);
+        if (run(fmt, dir)) return -1;
+    }
+    return 0;
+}
+
+static pid_t start_server(uint16_t port) {
+    char accept_port[8], cert[64], key[64];
+    snprintf(accept_port, sizeof(accept_port), "%u", port);
+    snprintf(cert, sizeof(cert), "%s/server.pem", dir);
+    snprintf(key, sizeof(key), "%s/server.key", dir);
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execlp("openssl", "openssl", "s_server", "-accept", accept_port,
+               "-cert", cert, "-key", key, "-www", "-quiet", (char *) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Wait until the server accepts connections.
+ */
+static int wait_listening(const struct sockaddr_in *addr) {
+    for (int i = 0; i < 100; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int rv = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+        close(fd);
+        if (rv == 0) return 1;
+        nanosleep(&(struct timespec) {0, 50 * 1000 * 1000}, NULL);
+    }
+    return 0;
+}
+
+int main(void) {
+    struct tls_result r;
+    struct sockaddr_in addr;
+    void *session = NULL;
+    void *logger = test_init(0);
+    if (system("openssl version >/dev/null 2>&1") != 0) {
+        fprintf(stderr, "openssl is not installed, skipped.\n");
+        return TEST_SKIPPED;
+    }
+    if (!mkdtemp(dir) || make_certs()) die("Cannot create certificates.\n");
+    close(test_bind(SOCK_STREAM, &addr));
+    uint16_t port = ntohs(addr.sin_port);
+    pid_t pid = start_server(port);
+    if (!wait_listening(&addr)) die("openssl s_server did not start.\n");
+
+    char ca[64];
+    snprintf(ca, sizeof(ca), "%s/ca.pem", dir);
+    tls_set_ca(ca);
+
+    CHECK(check_https(logger, "localhost", port, "/", &session, &r) == 0);
+    CHECK(r.status == 200 && !r.resumed);
+    CHECK(r.resolve_us >= 0 && r.connect_us >= 0 && r.handshake_us >= 0 &&
+          r.ttfb_us >= 0);
+    CHECK(session != NULL);
+
+    // the next check resumes the session of the last one
+    CHECK(check_https(logger, "localhost", port, "/", &session, &r) == 0);
+    CHECK(r.status == 200 && r.resumed);
+
+    // an IP address is verified against the addresses of the certificate
+    tls_forget(&session);
+    CHECK(check_https(logger, "127.0.0.1", port, "/", &session, &r) == 0);
+    CHECK(r.status == 200);
+    tls_forget(&session);
+    CHECK(check_https(logger, "127.0.0.2", port, "/", &session, &r) != 0);
+    CHECK(r.handshake_us < 0 && session == NULL);
+
+    tls_forget(&session);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    run("rm -rf %s", dir);
+    log_free(logger);
+    return test_failures ? 1 : 0;
+}
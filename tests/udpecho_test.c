@@ -0,0 +1,133 @@
+//
+// Created by Keuin on 2022/1/21.
+//
+// UDP echo probe against netmon's reflector and against a stub that
+// misbehaves on purpose. Of every five packets the stub
+//
+//   0  reflects it
+//   1  drops it
+//   2  reflects it twice
+//   3  holds it back until the next one is reflected
+//   4  reflects it, then the held one
+//
+// The lying stub reflects everything with receive and transmit times
+// far apart, as if its clock stepped.
+//
+
+#include <endian.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "udpecho.h"
+#include "test.h"
+
+// packets of one probe, and packets per second
+#define COUNT 10
+#define RATE 100
+
+static void stub(int sock, int lying) {
+    struct udp_echo_packet pkt, held;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    int holding = 0;
+    while (recvfrom(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *) &from,
+                    &len) == sizeof(pkt)) {
+        if (lying) {
+            pkt.t2 = 0;
+            pkt.t3 = htobe64(3600ULL * 1000000000ULL);
+            sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *) &from, len);
+            continue;
+        }
+        switch (ntohl(pkt.seq) % 5) {
+            case 1:
+                break;
+            case 2:
+                sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *) &from,
+                       len);
+                sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *) &from,
+                       len);
+                break;
+            case 3:
+                held = pkt;
+                holding = 1;
+                break;
+            default:
+                sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *) &from,
+                       len);
+                if (holding)
+                    sendto(sock, &held, sizeof(held), 0,
+                           (struct sockaddr *) &from, len);
+                holding = 0;
+        }
+        len = sizeof(from);
+    }
+}
+
+static pid_t start_stub(struct sockaddr_in *addr, int lying) {
+    int sock = test_bind(SOCK_DGRAM, addr);
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) {
+        stub(sock, lying);
+        _exit(0);
+    }
+    close(sock);
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+int main(void) {
+    static struct udp_echo_probe probe;
+    struct udp_echo_result r;
+    struct sockaddr_in addr;
+    void *logger = test_init(reflector_footprint());
+
+    // netmon's own reflector
+    close(test_bind(SOCK_DGRAM, &addr));
+    pid_t pid = fork();
+    if (pid < 0) die("fork() failed.\n");
+    if (pid == 0) _exit(reflector_run(logger, ntohs(addr.sin_port)));
+    // packets sent before it listens are lost, give it a few probes
+    int rv = -1;
+    for (int i = 0; i < 20 && (rv || r.received < COUNT); ++i)
+        rv = check_udp_echo(logger, &probe, &addr, COUNT, RATE, &r);
+    CHECK(rv == 0);
+    CHECK(r.sent == COUNT && r.received == COUNT);
+    CHECK(r.duplicates == 0 && r.reordered == 0);
+    CHECK(r.rtt_min_us >= 0 && r.rtt_min_us <= r.rtt_avg_us &&
+          r.rtt_avg_us <= r.rtt_max_us && r.rtt_max_us < 1000000);
+    CHECK(r.owd_valid);
+    stop(pid);
+
+    pid = start_stub(&addr, 0);
+    CHECK(check_udp_echo(logger, &probe, &addr, COUNT, RATE, &r) == 0);
+    CHECK(r.sent == COUNT);
+    CHECK(r.received == COUNT - COUNT / 5);
+    CHECK(r.duplicates == COUNT / 5);
+    CHECK(r.reordered == COUNT / 5);
+    // a held packet waited for the next one, about 1 / RATE seconds
+    CHECK(r.rtt_max_us >= 1000000 / RATE / 2);
+    stop(pid);
+
+    // nobody listens, the check fails
+    close(test_bind(SOCK_DGRAM, &addr));
+    CHECK(check_udp_echo(logger, &probe, &addr, COUNT, RATE, &r) != 0);
+    CHECK(r.sent == COUNT && r.received == 0);
+
+    // RTTs come from our monotonic clock, whatever the reflector stamps
+    pid = start_stub(&addr, 1);
+    CHECK(check_udp_echo(logger, &probe, &addr, COUNT, RATE, &r) == 0);
+    CHECK(r.received == COUNT);
+    CHECK(r.rtt_min_us > 0 && r.rtt_max_us < 1000000);
+    CHECK(!r.owd_valid);
+    stop(pid);
+
+    log_free(logger);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,341 @@
+//
+// Created by Keuin on 2022/1/18.
+//
+// HTTPS check: resolve, connect, handshake and fetch the status line,
+// timing each phase on its own. The certificate chain and host name (or
+// IP address) are verified.
+// The session (or TLS 1.3 ticket) of the last check is offered again, so
+// a steady-state check resumes it instead of doing a full handshake.
+//
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "logging.h"
+#include "tls.h"
+#include "validate.h"
+
+// created on first use, loading the CA certificates is not cheap
+static SSL_CTX *ctx = NULL;
+// if NULL, use the system CA certificates
+static const char *ca = NULL;
+
+// the host name lookup in flight. One that timed out keeps running in the
+// resolver's thread and owns the request until it finishes, so there is
+// only one at a time
+static struct {
+    int busy;
+    struct gaicb req;
+    struct addrinfo hints;
+    char host[256];
+    char service[8];
+} lookup;
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Verify servers against the CA certificates in this file instead of
+ * the system ones. Must be called before the first check.
+ */
+void tls_set_ca(const char *cafile) {
+    ca = cafile;
+}
+
+static SSL_CTX *get_ctx(void *logger) {
+    if (ctx) return ctx;
+    if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+        log_error(logger, "Cannot create the TLS context.");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    // sessions are kept by the targets, not in the context
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    if (!(ca ? SSL_CTX_load_verify_locations(ctx, ca, NULL) :
+          SSL_CTX_set_default_verify_paths(ctx))) {
+        log_error(logger, "Cannot load CA certificates.");
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Wait until the socket is ready for the events.
+ * @return Zero if ready, non-zero if timed out or failed.
+ */
+static int wait_fd(int fd, short events, long long deadline) {
+    while (1) {
+        long long left = deadline - monotonic_us();
+        if (left <= 0) return -1;
+        struct pollfd pfd = {fd, events, 0};
+        int n = poll(&pfd, 1, (int) ((left + 999) / 1000));
+        if (n > 0) return 0;
+        if (n < 0 && errno != EINTR) return -1;
+    }
+}
+
+/**
+ * Wait for what a non-blocking SSL call asked for.
+ * @return Zero to retry the call, non-zero if it failed.
+ */
+static int want(SSL *ssl, int fd, int rv, long long deadline) {
+    switch (SSL_get_error(ssl, rv)) {
+        case SSL_ERROR_WANT_READ:
+            return wait_fd(fd, POLLIN, deadline);
+        case SSL_ERROR_WANT_WRITE:
+            return wait_fd(fd, POLLOUT, deadline);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Resolve the host like getaddrinfo() does, but give up at the deadline.
+ * @param ai where to store the addresses, release with freeaddrinfo().
+ * @return Zero if success, non-zero if failed.
+ */
+static int resolve(void *logger, const char *host, uint16_t port,
+                   long long deadline, struct addrinfo **ai) {
+    struct gaicb *list[1] = {&lookup.req};
+    if (lookup.busy) {
+        if (gai_error(&lookup.req) == EAI_INPROGRESS) {
+            log_error(logger, "Last lookup of the HTTPS host is still running.");
+            return -1;
+        }
+        if (lookup.req.ar_result) freeaddrinfo(lookup.req.ar_result);
+        lookup.busy = 0;
+    }
+    if (strlen(host) >= sizeof(lookup.host)) {
+        log_error(logger, "HTTPS host name is too long.");
+        return -1;
+    }
+    memset(&lookup.req, 0, sizeof(lookup.req));
+    memset(&lookup.hints, 0, sizeof(lookup.hints));
+    lookup.hints.ai_family = AF_INET;
+    lookup.hints.ai_socktype = SOCK_STREAM;
+    strcpy(lookup.host, host);
+    snprintf(lookup.service, sizeof(lookup.service), "%u", port);
+    lookup.req.ar_name = lookup.host;
+    lookup.req.ar_service = lookup.service;
+    lookup.req.ar_request = &lookup.hints;
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, NULL) != 0) {
+        log_error(logger, "Cannot start resolving HTTPS host.");
+        return -1;
+    }
+    lookup.busy = 1;
+    while (gai_error(&lookup.req) == EAI_INPROGRESS) {
+        long long left = deadline - monotonic_us();
+        if (left <= 0) {
+            log_error(logger, "Resolving HTTPS host timed out.");
+            return -1;
+        }
+        struct timespec ts = {(time_t) (left / 1000000),
+                              (long) (left % 1000000) * 1000};
+        gai_suspend((const struct gaicb *const *) list, 1, &ts);
+    }
+    lookup.busy = 0;
+    *ai = lookup.req.ar_result;
+    if (gai_error(&lookup.req) != 0 || !*ai) {
+        if (*ai) freeaddrinfo(*ai);
+        log_error(logger, "Cannot resolve HTTPS host.");
+        return -1;
+    }
+    return 0;
+}
+
+static int tcp_connect(void *logger, const struct addrinfo *ai,
+                       long long deadline) {
+    int fd, err = 0;
+    socklen_t len = sizeof(err);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    if ((connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+         errno != EINPROGRESS) ||
+        wait_fd(fd, POLLOUT, deadline) ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        log_error(logger, "connect() to HTTPS host failed.");
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * Set up the name to verify the certificate against. An IP address goes
+ * without SNI, which must not carry one, and is matched against the IP
+ * addresses of the certificate.
+ * @return Non-zero if success, zero if failed.
+ */
+static int set_peer(SSL *ssl, const char *host) {
+    unsigned char addr[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, host, addr) == 1 ||
+        inet_pton(AF_INET6, host, addr) == 1)
+        return X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    return SSL_set_tlsext_host_name(ssl, host) && SSL_set1_host(ssl, host);
+}
+
+/**
+ * Read until the status line is complete.
+ * @return The status code, or 0 if the response is not HTTP.
+ */
+static int read_status(SSL *ssl, int fd, long long deadline, long long t0,
+                       long *ttfb_us) {
+    char buf[64];
+    int len = 0, status = 0;
+    while (len < (int) sizeof(buf) - 1 && !memchr(buf, '\n', (size_t) len)) {
+        int rd = SSL_read(ssl, buf + len, (int) sizeof(buf) - 1 - len);
+        if (rd > 0) {
+            if (len == 0) *ttfb_us = (long) (monotonic_us() - t0);
+            len += rd;
+        } else if (want(ssl, fd, rd, deadline)) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+    if (sscanf(buf, "HTTP/%*d.%*d %3d", &status) != 1) return 0;
+    return status;
+}
+
+/**
+ * Check network availability by fetching a page over HTTPS. Only the
+ * status line of the response is read.
+ * @param logger the logger.
+ * @param host the server name or IP address, verified against its
+ * certificate.
+ * @param port the server port.
+ * @param path the path to request.
+ * @param session the session of the last check, updated for the next
+ * one. Release it with tls_forget().
+ * @param result if not null, store the timings here.
+ * @return Zero if the certificate is valid and the status is 2xx or 3xx,
+ * non-zero otherwise.
+ */
+int check_https(void *logger, const char *host, uint16_t port,
+                const char *path, void **session, struct tls_result *result) {
+    struct tls_result r = {-1, -1, -1, -1, 0, 0};
+    struct addrinfo *ai = NULL;
+    SSL_CTX *c = get_ctx(logger);
+    SSL *ssl = NULL;
+    int fd = -1, rv = -1;
+    char buf[192 + TLS_PATH_MAX];
+    NOTNULL(host);
+    NOTNULL(path);
+    if (!c) return -1;
+
+    long long ts = monotonic_us();
+    if (resolve(logger, host, port, ts + TLS_TIMEOUT_MS * 1000LL, &ai))
+        goto RET;
+    long long t0 = monotonic_us();
+    r.resolve_us = (long) (t0 - ts);
+    fd = tcp_connect(logger, ai, t0 + TLS_TIMEOUT_MS * 1000LL);
+    freeaddrinfo(ai);
+    if (fd < 0) goto RET;
+    long long t1 = monotonic_us();
+    r.connect_us = (long) (t1 - t0);
+
+    if ((ssl = SSL_new(c)) == NULL || !SSL_set_fd(ssl, fd) ||
+        !set_peer(ssl, host)) {
+        log_error(logger, "Cannot set up the TLS connection.");
+        goto RET;
+    }
+    if (*session) SSL_set_session(ssl, *session);
+    long long deadline = t1 + TLS_TIMEOUT_MS * 1000LL;
+    int n;
+    while ((n = SSL_connect(ssl)) != 1) {
+        if (want(ssl, fd, n, deadline)) {
+            long verify = SSL_get_verify_result(ssl);
+            snprintf(buf, sizeof(buf), "TLS handshake failed: %s.",
+                     verify != X509_V_OK ?
+                     X509_verify_cert_error_string(verify) :
+                     "protocol error or timeout");
+            log_error(logger, buf);
+            // do not offer a session the server may have choked on
+            tls_forget(session);
+            goto RET;
+        }
+    }
+    long long t2 = monotonic_us();
+    r.handshake_us = (long) (t2 - t1);
+    r.resumed = SSL_session_reused(ssl);
+
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                                         "User-Agent: netmon\r\n"
+                                         "Connection: close\r\n\r\n",
+                       path, host);
+    if (len < 0 || len >= (int) sizeof(buf)) {
+        log_error(logger, "HTTPS request is too long.");
+        goto RET;
+    }
+    deadline = t2 + TLS_TIMEOUT_MS * 1000LL;
+    while ((n = SSL_write(ssl, buf, len)) <= 0) {
+        if (want(ssl, fd, n, deadline)) {
+            log_error(logger, "Cannot send the HTTPS request.");
+            goto RET;
+        }
+    }
+    r.status = read_status(ssl, fd, deadline, t2, &r.ttfb_us);
+
+    // TLS 1.3 tickets arrive after the handshake, so take it only now
+    SSL_SESSION *s = SSL_get1_session(ssl);
+    if (s && SSL_SESSION_is_resumable(s)) {
+        tls_forget(session);
+        *session = s;
+    } else if (s) {
+        SSL_SESSION_free(s);
+    }
+
+    snprintf(buf, sizeof(buf), "HTTPS: resolve %ld us, connect %ld us, "
+                               "handshake %ld us%s, ttfb %ld us, status %d.",
+             r.resolve_us, r.connect_us, r.handshake_us,
+             r.resumed ? " (resumed)" : "",
+             r.ttfb_us, r.status);
+    log_debug(logger, buf);
+    if (r.status >= 200 && r.status < 400) {
+        rv = 0;
+    } else if (r.status == 0) {
+        log_error(logger, "No valid HTTP response over TLS.");
+    } else {
+        snprintf(buf, sizeof(buf), "HTTPS status is %d.", r.status);
+        log_error(logger, buf);
+    }
+
+    RET:
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    if (fd >= 0) close(fd);
+    // errors are reported above, do not let them pile up in the queue
+    ERR_clear_error();
+    if (result) *result = r;
+    return rv;
+}
+
+/**
+ * Release the session kept for resumption.
+ */
+void tls_forget(void **session) {
+    if (*session) SSL_SESSION_free(*session);
+    *session = NULL;
+}
@@ -0,0 +1,40 @@
+//
+// Created by Keuin on 2022/1/18.
+//
+
+#ifndef NETMON_TLS_H
+#define NETMON_TLS_H
+
+#include <stdint.h>
+
+#define TLS_DEFAULT_PORT 443
+// timeout of each phase of an HTTPS check, in milliseconds
+#define TLS_TIMEOUT_MS 5000
+// max length of the request path, including the terminating zero
+#define TLS_PATH_MAX 128
+
+/**
+ * Timings of one HTTPS check, in microseconds. A phase that was not
+ * reached is -1.
+ */
+struct tls_result {
+    // host name lookup, bounded by TLS_TIMEOUT_MS like the other phases
+    long resolve_us;
+    long connect_us;
+    long handshake_us;
+    // from the request being sent to the first byte of the response
+    long ttfb_us;
+    // HTTP status code, 0 if no valid status line was received
+    int status;
+    // non-zero if the handshake resumed the session of the last check
+    int resumed;
+};
+
+void tls_set_ca(const char *cafile);
+
+int check_https(void *logger, const char *host, uint16_t port,
+                const char *path, void **session, struct tls_result *result);
+
+void tls_forget(void **session);
+
+#endif //NETMON_TLS_H
@@ -0,0 +1,271 @@
+//
+// Created by Keuin on 2022/1/15.
+//
+// UDP echo probe in the spirit of TWAMP-light: sequenced, timestamped
+// packets are sent to a reflector at a fixed rate, and the reflector
+// sends them back with its own receive and transmit timestamps added.
+//
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "logging.h"
+#include "udpecho.h"
+#include "validate.h"
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void on_reply(struct udp_echo_probe *st, struct udp_echo_result *r,
+                     const struct udp_echo_packet *pkt, uint64_t t4,
+                     long long t4_us) {
+    uint32_t seq = ntohl(pkt->seq);
+    if (ntohl(pkt->magic) != UDP_ECHO_MAGIC || seq >= r->sent) return;
+    if (st->seen[seq / 8] & (1u << (seq % 8))) {
+        ++r->duplicates;
+        return;
+    }
+    st->seen[seq / 8] |= (uint8_t) (1u << (seq % 8));
+    if (st->any && seq < st->max_seq) ++r->reordered;
+    if (!st->any || seq > st->max_seq) st->max_seq = seq;
+    st->any = 1;
+
+    int64_t t1 = (int64_t) be64toh(pkt->t1), t2 = (int64_t) be64toh(pkt->t2),
+            t3 = (int64_t) be64toh(pkt->t3);
+    // the round trip on our monotonic clock, a step of the wall clock
+    // must not show up as delay
+    long rtt = (long) (t4_us - st->start_us - st->sent_us[seq]);
+    // time spent in the reflector does not count, unless its clock
+    // stepped meanwhile
+    long held = (long) ((t3 - t2) / 1000);
+    if (held >= 0 && held < rtt) rtt -= held;
+    if (r->received == 0 || rtt < r->rtt_min_us) r->rtt_min_us = rtt;
+    if (rtt > r->rtt_max_us) r->rtt_max_us = rtt;
+    st->rtt_sum += rtt;
+    long long fwd = (t2 - t1) / 1000, back = ((int64_t) t4 - t3) / 1000;
+    if (fwd < 0 || back < 0) r->owd_valid = 0;
+    st->fwd_sum += fwd;
+    st->back_sum += back;
+    ++r->received;
+}
+
+static void drain(int sock, struct udp_echo_probe *st,
+                  struct udp_echo_result *r) {
+    struct udp_echo_packet pkt;
+    ssize_t rd;
+    while ((rd = recv(sock, &pkt, sizeof(pkt), MSG_DONTWAIT)) >= 0) {
+        if ((size_t) rd == sizeof(pkt))
+            on_reply(st, r, &pkt, realtime_ns(), monotonic_us());
+    }
+}
+
+/**
+ * Check network availability by exchanging UDP packets with a reflector.
+ * @param logger the logger.
+ * @param st state of the probe.
+ * @param dest address of the reflector.
+ * @param count packets to send.
+ * @param rate packets per second.
+ * @param result if not null, store the measurements here.
+ * @return Zero if no more than UDP_ECHO_MAX_LOSS percent is lost,
+ * non-zero otherwise.
+ */
+int check_udp_echo(void *logger, struct udp_echo_probe *st,
+                   const struct sockaddr_in *dest, uint32_t count,
+                   uint32_t rate, struct udp_echo_result *result) {
+    struct udp_echo_result r;
+    int sock;
+    NOTNULL(st);
+    NOTNULL(dest);
+    if (count == 0 || count > UDP_ECHO_MAX_COUNT || rate == 0) {
+        log_error(logger, "Invalid UDP echo count or rate.");
+        return -1;
+    }
+    // only the packets of this probe are looked at, no need to clear all
+    memset(st, 0, offsetof(struct udp_echo_probe, sent_us));
+    memset(st->seen, 0, (count + 7) / 8);
+    memset(&r, 0, sizeof(r));
+    r.owd_valid = 1;
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    if (connect(sock, (const struct sockaddr *) dest, sizeof(*dest)) < 0) {
+        perror("connect()");
+        log_error(logger, "connect() to reflector failed.");
+        close(sock);
+        return -1;
+    }
+
+    long long gap_us = 1000000LL / rate;
+    long long start = monotonic_us(), deadline = 0;
+    st->start_us = start;
+    while (1) {
+        long long now = monotonic_us();
+        if (r.sent < count && now >= start + (long long) r.sent * gap_us) {
+            struct udp_echo_packet pkt;
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.magic = htonl(UDP_ECHO_MAGIC);
+            pkt.seq = htonl(r.sent);
+            pkt.t1 = htobe64(realtime_ns());
+            st->sent_us[r.sent] = (uint32_t) (monotonic_us() - start);
+            // a refused send (e.g. ICMP port unreachable) is just a loss
+            send(sock, &pkt, sizeof(pkt), 0);
+            if (++r.sent == count)
+                deadline = monotonic_us() + UDP_ECHO_WAIT_MS * 1000LL;
+            continue;
+        }
+        long long wake = (r.sent < count) ?
+                         start + (long long) r.sent * gap_us : deadline;
+        if (r.sent == count && (now >= deadline || r.received == count))
+            break;
+        struct pollfd pfd = {sock, POLLIN, 0};
+        int timeout = (int) ((wake - now + 999) / 1000);
+        if (poll(&pfd, 1, timeout > 0 ? timeout : 0) > 0) drain(sock, st, &r);
+    }
+    close(sock);
+
+    if (r.received > 0) {
+        r.rtt_avg_us = (long) (st->rtt_sum / r.received);
+        r.owd_fwd_avg_us = (long) (st->fwd_sum / r.received);
+        r.owd_back_avg_us = (long) (st->back_sum / r.received);
+    } else {
+        r.owd_valid = 0;
+    }
+    char buf[192];
+    snprintf(buf, sizeof(buf),
+             "UDP echo: sent %u, received %u, dup %u, reordered %u, "
+             "rtt min/avg/max %ld/%ld/%ld us.",
+             r.sent, r.received, r.duplicates, r.reordered,
+             r.rtt_min_us, r.rtt_avg_us, r.rtt_max_us);
+    log_debug(logger, buf);
+    if (r.owd_valid) {
+        snprintf(buf, sizeof(buf), "UDP echo: one-way delay fwd %ld us, "
+                                   "back %ld us.",
+                 r.owd_fwd_avg_us, r.owd_back_avg_us);
+        log_debug(logger, buf);
+    }
+    if (result) *result = r;
+    if ((uint64_t) (r.sent - r.received) * 100 > (uint64_t) r.sent *
+                                                 UDP_ECHO_MAX_LOSS) {
+        log_error(logger, "Too many UDP echo packets are lost.");
+        return -1;
+    }
+    return 0;
+}
+
+struct reflector {
+    struct udp_echo_packet pkts[UDP_ECHO_BATCH];
+    struct sockaddr_in addrs[UDP_ECHO_BATCH];
+    struct iovec iovs[UDP_ECHO_BATCH];
+    struct mmsghdr msgs[UDP_ECHO_BATCH];
+};
+
+/**
+ * @return Bytes the reflector will allocate from the arena.
+ */
+size_t reflector_footprint(void) {
+    return sizeof(struct reflector);
+}
+
+/**
+ * Run as a reflector. Never returns unless failed.
+ * @param logger the logger.
+ * @param port UDP port to listen on.
+ * @return Non-zero if failed.
+ */
+int reflector_run(void *logger, uint16_t port) {
+    struct reflector *rf = arena_alloc(sizeof(struct reflector));
+    struct sockaddr_in addr;
+    int sock;
+    if (!rf) {
+        log_error(logger, "Cannot allocate the reflector.");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket()");
+        log_error(logger, "socket() failed.");
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        log_error(logger, "bind() failed.");
+        close(sock);
+        return -1;
+    }
+    for (int i = 0; i < UDP_ECHO_BATCH; ++i) {
+        rf->iovs[i].iov_base = &rf->pkts[i];
+        rf->iovs[i].iov_len = sizeof(rf->pkts[i]);
+        rf->msgs[i].msg_hdr.msg_iov = &rf->iovs[i];
+        rf->msgs[i].msg_hdr.msg_iovlen = 1;
+        rf->msgs[i].msg_hdr.msg_name = &rf->addrs[i];
+    }
+
+    char buf[64];
+    snprintf(buf, 63, "Reflector is listening on port %u.", port);
+    log_info(logger, buf);
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "EndlessLoop"
+    while (1) {
+        for (int i = 0; i < UDP_ECHO_BATCH; ++i)
+            rf->msgs[i].msg_hdr.msg_namelen = sizeof(rf->addrs[i]);
+        int n = recvmmsg(sock, rf->msgs, UDP_ECHO_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recvmmsg()");
+            log_error(logger, "recvmmsg() failed.");
+            return -1;
+        }
+        uint64_t t2 = realtime_ns();
+        int out = 0;
+        for (int i = 0; i < n; ++i) {
+            struct udp_echo_packet *pkt = &rf->pkts[i];
+            if (rf->msgs[i].msg_len != sizeof(*pkt) ||
+                ntohl(pkt->magic) != UDP_ECHO_MAGIC)
+                continue; // not ours, never reflect garbage
+            pkt->t2 = htobe64(t2);
+            // compact the batch so only valid packets are sent back
+            if (out != i) {
+                rf->pkts[out] = *pkt;
+                rf->addrs[out] = rf->addrs[i];
+                rf->msgs[out].msg_hdr.msg_namelen =
+                        rf->msgs[i].msg_hdr.msg_namelen;
+            }
+            ++out;
+        }
+        uint64_t t3 = realtime_ns();
+        for (int i = 0; i < out; ++i) {
+            rf->pkts[i].t3 = htobe64(t3);
+            rf->iovs[i].iov_len = sizeof(rf->pkts[i]);
+        }
+        if (out > 0 && sendmmsg(sock, rf->msgs, (unsigned) out, 0) < 0 &&
+            errno != EAGAIN) {
+            perror("sendmmsg()");
+        }
+    }
+#pragma clang diagnostic pop
+}
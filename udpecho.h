@@ -0,0 +1,82 @@
+//
+// Created by Keuin on 2022/1/15.
+//
+
+#ifndef NETMON_UDPECHO_H
+#define NETMON_UDPECHO_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define UDP_ECHO_MAGIC 0x4E4D5545u // "NMUE"
+#define UDP_ECHO_DEFAULT_PORT 8620
+#define UDP_ECHO_DEFAULT_COUNT 10
+#define UDP_ECHO_DEFAULT_RATE 10
+// max packets of one probe, bounds the duplicate bitmap
+#define UDP_ECHO_MAX_COUNT 4096
+// time to wait for replies after the last packet is sent, in milliseconds
+#define UDP_ECHO_WAIT_MS 1000
+// a probe fails if more than this percentage of packets is lost
+#define UDP_ECHO_MAX_LOSS 50
+// packets received with one recvmmsg() call by the reflector
+#define UDP_ECHO_BATCH 32
+
+/*
+ * Packet layout, all fields in network byte order. Timestamps are
+ * CLOCK_REALTIME in nanoseconds, so one-way delays are only meaningful
+ * if the clocks of both ends are synchronized. RTTs are taken from the
+ * monotonic clock of the sender instead, see struct udp_echo_probe.
+ */
+struct udp_echo_packet {
+    uint32_t magic;
+    uint32_t seq;
+    // sender transmit time
+    uint64_t t1;
+    // reflector receive time
+    uint64_t t2;
+    // reflector transmit time
+    uint64_t t3;
+};
+
+struct udp_echo_result {
+    uint32_t sent;
+    // unique replies
+    uint32_t received;
+    uint32_t duplicates;
+    // replies arriving after one with a higher sequence number
+    uint32_t reordered;
+    long rtt_min_us;
+    long rtt_avg_us;
+    long rtt_max_us;
+    // zero if one-way delays came out negative, i.e. clocks are not synced
+    int owd_valid;
+    long owd_fwd_avg_us;
+    long owd_back_avg_us;
+};
+
+/**
+ * State of one probe. Fixed size, so a probe never allocates; too large
+ * for the stack of a small router, so the caller keeps it.
+ */
+struct udp_echo_probe {
+    uint32_t max_seq;
+    int any;
+    long long rtt_sum;
+    long long fwd_sum;
+    long long back_sum;
+    // CLOCK_MONOTONIC time the probe started, in microseconds
+    long long start_us;
+    // when each packet was sent, in microseconds since start_us
+    uint32_t sent_us[UDP_ECHO_MAX_COUNT];
+    uint8_t seen[UDP_ECHO_MAX_COUNT / 8];
+};
+
+int check_udp_echo(void *logger, struct udp_echo_probe *probe,
+                   const struct sockaddr_in *dest, uint32_t count,
+                   uint32_t rate, struct udp_echo_result *result);
+
+size_t reflector_footprint(void);
+
+int reflector_run(void *logger, uint16_t port);
+
+#endif //NETMON_UDPECHO_H
@@ -3,7 +3,9 @@
 //
 
 #include "validate.h"
+#include <arpa/inet.h>
 #include <stdio.h>
+#include <string.h>
 
 /**
  * Check if a given string is a valid dot-decimal representation of an IPv4 address.
@@ -21,3 +23,31 @@ int is_valid_ipv4(const char *s) {
 //    }
     return 1;
 }
+
+/**
+ * Parse an endpoint in the form of `ip` or `ip:port`.
+ * @param s the string.
+ * @param default_port port to use if not given, in host byte order.
+ * @param addr where to store the address.
+ * @return Zero if success, non-zero if failed.
+ */
+int parse_ipv4_endpoint(const char *s, uint16_t default_port,
+                        struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strchr(s, ':');
+    size_t hlen = colon ? (size_t) (colon - s) : strlen(s);
+    long port = default_port;
+    if (hlen == 0 || hlen >= sizeof(host)) return -1;
+    memcpy(host, s, hlen);
+    host[hlen] = '\0';
+    if (colon) {
+        char *end;
+        port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535) return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t) port);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) return -1;
+    return 0;
+}
@@ -5,10 +5,15 @@
 #ifndef NETMON_VALIDATE_H
 #define NETMON_VALIDATE_H
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <netinet/in.h>
 
 int is_valid_ipv4(const char *s);
 
+int parse_ipv4_endpoint(const char *s, uint16_t default_port,
+                        struct sockaddr_in *addr);
+
 #define NOTNULL(ptr) do { \
                           if ((ptr) == NULL) { \
                            fprintf(stderr, "NotNull check failed: "#ptr " is null. (" __FILE__ ":%d)\n", __LINE__); \